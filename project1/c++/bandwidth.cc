@@ -3,8 +3,10 @@
 
 #include "basic_service.h"
 #include "measure.h"
+#include <algorithm>
+#include <cstdlib>
 
-int run_client(std::string);
+int run_client(std::string, int, Report*);
 int run_server(std::string);
 
 // data to be passed to measurement functions.
@@ -23,7 +25,13 @@ struct roundtrip {
     }
 };
 
+// usage: bandwidth [--json file | --csv file] SERVER|CLIENT address [runs]
 int main(int argc, char** argv) {
+    Report report;
+    if (!report.ParseOption(&argc, &argv)) {
+        std::cerr << "--json and --csv need a file to write the results to.\n";
+        return 1;
+    }
     if (argc < 3) {
         std::cerr << "Need SERVER or CLIENT followed by ADDRESS.\n";
         return 1;
@@ -33,7 +41,13 @@ int main(int argc, char** argv) {
     if (mode == "SERVER") {
         return run_server(argv[2]); 
     } else if (mode == "CLIENT") {
-        return run_client(argv[2]);
+        int runs = argc > 3 ? atoi(argv[3]) : 1;
+        int ret = run_client(argv[2], runs > 0 ? runs : 1, &report);
+        if (ret == 0 && !report.Write()) {
+            std::cerr << "could not write the results.\n";
+            return 1;
+        }
+        return ret;
     } else {
         std::cerr << "Need SERVER or CLIENT followed by ADDRESS.\n";
         return 1;
@@ -43,28 +57,39 @@ int main(int argc, char** argv) {
 
 
 // runs the client side of the test.
-int run_client(std::string address) {
+int run_client(std::string address, int runs, Report* report) {
     std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(address, grpc::InsecureCredentials());
     std::shared_ptr<basic_service::Stub> stub = basic_service::NewStub(channel);
     clocker::mode mode = clocker::clock_gettime;
     int count = basic_service_impl::count;    
+    long kbits = count * 2048 * 8 / 1024;
+    Report::Entry* entry = report->Add("streaming bandwidth");
 
     // create clock.
     clocker clk;
     std::cout << "client\n";
 
-    grpc::ClientContext context;
-    bulk_message msg;
-    tiny_message req;
-    clk.begin();
-    std::unique_ptr<grpc::ClientReader<bulk_message>> reader =
-      stub->pull_list(&context, req);
-    while (reader->Read(&msg)) { }
-    grpc::Status stat =  reader->Finish();
-    clk.end();
+    // every run pulls the whole list again; each is one sample of the
+    // distribution.
+    for (int run = 0; run < runs; ++run) {
+        grpc::ClientContext context;
+        bulk_message msg;
+        tiny_message req;
+        clk.begin();
+        std::unique_ptr<grpc::ClientReader<bulk_message>> reader =
+          stub->pull_list(&context, req);
+        while (reader->Read(&msg)) { }
+        grpc::Status stat =  reader->Finish();
+        clk.end();
 
-    std::cout << std::left << std::setw(60) << std::setfill(' ')
-      << "streaming bandwidth" << (count * 2048 * 8 / 1024) << " " << ((double)clk.difference() / 1000000000) << "\n";
+        std::cout << std::left << std::setw(60) << std::setfill(' ')
+          << "streaming bandwidth" << kbits << " " << ((double)clk.difference() / 1000000000) << "\n";
+        entry->distribution.Record(clk.difference());
+        entry->errors += !stat.ok();
+    }
+    entry->metrics.push_back(std::make_pair("kbits", (double)kbits));
+    entry->metrics.push_back(std::make_pair("kbits_per_s",
+      kbits * 1e9 / std::max(entry->distribution.GetMean(), 1L)));
     //std::cout << count * 65 * 8 << " " << clk.difference() << "\n"; 
     //clk.dump_cgt();
     return 0;
@@ -2,8 +2,30 @@
 // by: allison morris
 
 #include "grpc.pb.h"
+#include "file.pb.h"
+#include "buffer_pool.h"
 #include "clocker.h"
 #include "measure.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <google/protobuf/arena.h>
+#include <memory>
+#include <new>
+#include <vector>
+
+// counts every allocation, protobuf's included, for the "allocs" column.
+void* operator new(size_t size) {
+    allocation_count().fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) { throw std::bad_alloc(); }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
 
 // data object. contains message and data to pack in it.
 struct message_data {
@@ -83,6 +105,216 @@ struct pack_little_full {
     }
 };*/
 
+// wire data for the file.proto messages filed sends. msg is serialized into
+// wire once up front; out and parsed are reused by the warm variants, and
+// arena is reset after every reused-arena parse. arena starts with block,
+// which is big enough for the parsed message, so once reset it takes no
+// more blocks from the allocator. strings past the small-string buffer,
+// like DirInfo's names, still allocate their contents on the heap.
+template <class Message> struct wire_data {
+    Message msg;
+    Message parsed;
+    std::string wire;
+    std::string out;
+    std::shared_ptr<std::vector<char>> block;
+    std::shared_ptr<google::protobuf::Arena> arena;
+};
+
+template <class Message> struct byte_size {
+    void run(wire_data<Message>& data) {
+        do_not_optimize(data.msg.ByteSize());
+    }
+};
+
+// into a new string every time, which grows as it is written.
+template <class Message> struct serialize_cold {
+    void run(wire_data<Message>& data) {
+        std::string out;
+        data.msg.SerializeToString(&out);
+        do_not_optimize(out);
+    }
+};
+
+// into a string that kept its capacity from the last time.
+template <class Message> struct serialize_reused {
+    void run(wire_data<Message>& data) {
+        data.msg.SerializeToString(&data.out);
+    }
+};
+
+// into a new message on the heap, freed again afterwards.
+template <class Message> struct parse_cold {
+    void run(wire_data<Message>& data) {
+        Message msg;
+        msg.ParseFromString(data.wire);
+        do_not_optimize(msg);
+    }
+};
+
+// into the same message each time; parsing clears it but keeps its strings
+// and repeated fields allocated.
+template <class Message> struct parse_reused {
+    void run(wire_data<Message>& data) {
+        data.parsed.ParseFromString(data.wire);
+    }
+};
+
+// into a message on a new arena, as a server would use one per call.
+template <class Message> struct parse_arena {
+    void run(wire_data<Message>& data) {
+        google::protobuf::Arena arena;
+        Message* msg = google::protobuf::Arena::CreateMessage<Message>(&arena);
+        msg->ParseFromString(data.wire);
+        do_not_optimize(*msg);
+    }
+};
+
+// into a message on an arena that is reset and reused, so after the first
+// call it no longer asks the allocator for blocks.
+template <class Message> struct parse_arena_reused {
+    void run(wire_data<Message>& data) {
+        Message* msg = google::protobuf::Arena::CreateMessage<Message>(data.arena.get());
+        msg->ParseFromString(data.wire);
+        do_not_optimize(*msg);
+        data.arena->Reset();
+    }
+};
+
+// times every way of sizing, serializing and parsing msg, under name.
+template <class Message> void measure_wire(const std::string& name, const Message& msg, clocker::mode mode, const bench_options& options, Report* report) {
+    wire_data<Message> data;
+    data.msg = msg;
+    data.msg.SerializeToString(&data.wire);
+    data.block = std::make_shared<std::vector<char>>(std::max<size_t>(data.wire.size() * 4, 4096));
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = data.block->data();
+    arena_options.initial_block_size = data.block->size();
+    data.arena = std::make_shared<google::protobuf::Arena>(arena_options);
+    std::string label = name + " (" + std::to_string(data.wire.size()) + " bytes) ";
+
+    benchmark(label + "byte size", byte_size<Message>(), data, mode, options, report);
+    benchmark(label + "serialize cold", serialize_cold<Message>(), data, mode, options, report);
+    benchmark(label + "serialize reused", serialize_reused<Message>(), data, mode, options, report);
+    benchmark(label + "parse cold", parse_cold<Message>(), data, mode, options, report);
+    benchmark(label + "parse reused", parse_reused<Message>(), data, mode, options, report);
+    benchmark(label + "parse arena", parse_arena<Message>(), data, mode, options, report);
+    benchmark(label + "parse arena reused", parse_arena_reused<Message>(), data, mode, options, report);
+}
+
+// fills info the way filed's SetFileInfo does for a regular file.
+void fill_info(File::FileInfo* info, const std::string& name) {
+    info->set_error_code(0);
+    info->set_mode(0100644);
+    info->set_name(name);
+    info->set_access_time(1447000000);
+    info->set_modification_time(1447000001);
+    info->set_creation_time(1447000002);
+    info->set_size(4096);
+    info->set_inode(1234567);
+    info->set_version(1447000000ul << 20);
+    info->set_sha256(std::string(32, '\x5a'));
+}
+
+// the messages filed sends: file info, downloads and uploads from 64 bytes
+// to 4m, and listings from 10 to a million entries.
+void measure_file_proto(clocker::mode mode, const bench_options& options, Report* report) {
+    File::FileInfo info;
+    fill_info(&info, "blob-4k");
+    measure_wire("FileInfo", info, mode, options, report);
+
+    for (long size : { 64L, 4096L, 256L * 1024, 4L * 1024 * 1024 }) {
+        std::string contents(size, 'x');
+        File::File file;
+        fill_info(file.mutable_info(), "blob");
+        file.set_contents(contents);
+        measure_wire("File " + std::to_string(size), file, mode, options, report);
+
+        File::FileData upload;
+        upload.mutable_path()->set_data("/dir/blob");
+        upload.set_contents(contents);
+        measure_wire("FileData " + std::to_string(size), upload, mode, options, report);
+    }
+
+    for (long entries : { 10L, 1000L, 100000L, 1000000L }) {
+        File::DirInfo dir;
+        char name[32];
+        for (long i = 0; i < entries; ++i) {
+            snprintf(name, sizeof(name), "file-%07ld.dat", i);
+            dir.add_contents(name);
+        }
+        measure_wire("DirInfo " + std::to_string(entries), dir, mode, options, report);
+    }
+}
+
+// a file to stream, in chunks the size filed sends. wire stands in for the
+// buffer grpc serializes each chunk into.
+struct stream_data {
+    static const size_t chunk_size = 256 * 1024;
+    std::string file;
+    std::string wire;
+};
+
+const size_t stream_data::chunk_size;
+
+// one streamed download, built the way filed's DownloadFileStream and
+// SendChunks build it: with arenas the chunk is on a CallArena and its
+// body comes from the BufferPool, as under filed -A; without, both are
+// fresh from the heap every call. the copy out of file stands in for the
+// read.
+template <bool Arenas> struct stream_call {
+    void run(stream_data& data) {
+        File::CallArena arena(Arenas);
+        File::FileChunk* chunk = arena.Create<File::FileChunk>();
+        File::BufferPool::Buffer body(Arenas ? stream_data::chunk_size : 0);
+        body.Lend(chunk->mutable_contents());
+        fill_info(chunk->mutable_info(), "blob");
+        for (size_t offset = 0; offset < data.file.size(); offset += stream_data::chunk_size) {
+            size_t want = std::min(stream_data::chunk_size, data.file.size() - offset);
+            chunk->mutable_contents()->resize(want);
+            memcpy(&(*chunk->mutable_contents())[0], data.file.data() + offset, want);
+            chunk->set_offset(offset);
+            data.wire.resize(chunk->ByteSize());
+            chunk->SerializeToArray(&data.wire[0], data.wire.size());
+            chunk->clear_info();
+        }
+    }
+};
+
+// one listing, built entry by entry the way GetDirectoryContents does,
+// on the heap or on a CallArena.
+template <bool Arenas> struct list_call {
+    void run(std::vector<std::string>& names) {
+        File::CallArena arena(Arenas);
+        File::DirInfo* dir = arena.Create<File::DirInfo>();
+        for (const std::string& name : names) { dir->add_contents(name); }
+        do_not_optimize(*dir);
+    }
+};
+
+// allocations and time per call of streamed downloads and listings, with
+// and without arenas and pooled buffers.
+void measure_calls(clocker::mode mode, const bench_options& options, Report* report) {
+    for (long size : { 256L * 1024, 4L * 1024 * 1024, 64L * 1024 * 1024 }) {
+        stream_data data;
+        data.file.assign(size, 'x');
+        std::string label = "stream call " + std::to_string(size) + " bytes ";
+        benchmark(label + "heap", stream_call<false>(), data, mode, options, report);
+        benchmark(label + "arena", stream_call<true>(), data, mode, options, report);
+    }
+
+    for (long entries : { 1000L, 100000L }) {
+        std::vector<std::string> names;
+        char name[32];
+        for (long i = 0; i < entries; ++i) {
+            snprintf(name, sizeof(name), "file-%07ld.dat", i);
+            names.push_back(name);
+        }
+        std::string label = "list call " + std::to_string(entries) + " entries ";
+        benchmark(label + "heap", list_call<false>(), names, mode, options, report);
+        benchmark(label + "arena", list_call<true>(), names, mode, options, report);
+    }
+}
+
 std::string operator*(std::string str, int times) {
     std::string ret = str;
     for (int i = 0; i < times - 1; ++i) {
@@ -94,54 +326,110 @@ std::string operator*(std::string str, int times) {
     return ret;
 }
 
+// usage: marshalling [--json file | --csv file] [--counters] [--tsc]
+//   [--setters | --wire | --calls] [iterations]
+// iterations fixes the iterations per sample instead of calibrating them.
+// --tsc times with the time stamp counter instead of clock_gettime.
+// --setters, --wire and --calls run only the setter tests, only the
+// file.proto serialization suite or only the per-call allocation tests.
+// every test reports its allocations per iteration.
 int main(int argc, char** argv) {
     message_data data;
     clocker::mode mode = clocker::clock_gettime;
-    int count = 1;
-    
-    // basic measurements.
-    data.idata = 17;
-    data.fdata = 135.68;
-    data.ddata = 2125.1234;
-    data.ldata = 123456789098;
-    data.bdata = true;
-    measure("packing int 17", pack_int32(), data, mode, count);
-    measure("packing float 135.68", pack_float(), data, mode, count);
-    measure("packing double 2125.1234", pack_double(), data, mode, count);
-    
-    // string measurements.
-    data.sdata = " ";
-    measure("packing 1 char string", pack_string(), data, mode, count);
-    //data.sdata = "01234567";
-    data.sdata = data.sdata * 10;
-    measure("packing 10 char string", pack_string(), data, mode, count);
-    //data.sdata = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
-    data.sdata = data.sdata * 10;
-    measure("packing 100 char string", pack_string(), data, mode, count);
-    data.sdata = data.sdata * 10;
-    measure("packing 1000 char string", pack_string(), data, mode, count);
-    data.sdata = data.sdata * 10;
-    measure("packing 10000 char string", pack_string(), data, mode, count);
-    data.sdata = data.sdata * 10;
-    measure("packing 100000 char string", pack_string(), data, mode, count);
-    // full inner measurements.
- /*   data.sdata = "K";
-    measure("packing inner with 1 char string from raw", pack_little_full(), data, mode, count);
-    data.sdata = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
-    measure("packing inner with 64 char string from raw", pack_little_full(), data, mode, count);
-    data.sdata += data.sdata;
-    data.sdata += data.sdata;
-    measure("packing inner with 256 char string from raw", pack_little_full(), data, mode, count);
+    bench_options count;
+    count.allocations = true;
+    Report report;
+
+    if (!report.ParseOption(&argc, &argv)) {
+        std::cerr << "--json and --csv need a file to write the results to.\n";
+        return 1;
+    }
+    bool setters = true;
+    bool wire = true;
+    bool calls = true;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+        std::string option = argv[arg];
+        if (option == "--counters") {
+            count.counters = true;
+        } else if (option == "--tsc") {
+            mode = clocker::tsc;
+        } else if (option == "--setters") {
+            wire = false;
+            calls = false;
+        } else if (option == "--wire") {
+            setters = false;
+            calls = false;
+        } else if (option == "--calls") {
+            setters = false;
+            wire = false;
+        } else {
+            std::cerr << "unknown option " << option << ".\n";
+            return 1;
+        }
+    }
+    if (argc > arg) { count.iterations = std::max(1, atoi(argv[arg])); }
+
+    if (mode == clocker::tsc) {
+        std::cout << "timer: tsc at " << clocker::tsc_ns_per_tick() << " ns per tick";
+        if (!clocker::tsc_invariant()) { std::cout << " (not invariant; results are suspect)"; }
+    } else {
+        std::cout << "timer: clock_gettime";
+    }
+    std::cout << ", overhead " << clocker::overhead(mode) << " ns\n";
     
-    // simple inner measurements.
-    data.msg.mutable_ldata()->set_third("K");
-    measure("packing inner with 1 char string from packed", pack_little(), data, mode, count);
-    data.msg.mutable_ldata()->set_third("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
-    measure("packing inner with 64 char string from packed", pack_little(), data, mode, count);
-    data.msg.mutable_ldata()->set_third(data.sdata);
-    measure("packing inner with 256 char string from packed", pack_little(), data, mode, count);
- */  
-    // complex measurements.
-    measure("complex straight-up", pack_complex(), data, mode, count); 
+    if (setters) {
+        // basic measurements.
+        data.idata = 17;
+        data.fdata = 135.68;
+        data.ddata = 2125.1234;
+        data.ldata = 123456789098;
+        data.bdata = true;
+        benchmark("packing int 17", pack_int32(), data, mode, count, &report);
+        benchmark("packing float 135.68", pack_float(), data, mode, count, &report);
+        benchmark("packing double 2125.1234", pack_double(), data, mode, count, &report);
+
+        // string measurements.
+        data.sdata = " ";
+        benchmark("packing 1 char string", pack_string(), data, mode, count, &report);
+        //data.sdata = "01234567";
+        data.sdata = data.sdata * 10;
+        benchmark("packing 10 char string", pack_string(), data, mode, count, &report);
+        //data.sdata = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+        data.sdata = data.sdata * 10;
+        benchmark("packing 100 char string", pack_string(), data, mode, count, &report);
+        data.sdata = data.sdata * 10;
+        benchmark("packing 1000 char string", pack_string(), data, mode, count, &report);
+        data.sdata = data.sdata * 10;
+        benchmark("packing 10000 char string", pack_string(), data, mode, count, &report);
+        data.sdata = data.sdata * 10;
+        benchmark("packing 100000 char string", pack_string(), data, mode, count, &report);
+        // full inner measurements.
+     /*   data.sdata = "K";
+        measure("packing inner with 1 char string from raw", pack_little_full(), data, mode, count);
+        data.sdata = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+        measure("packing inner with 64 char string from raw", pack_little_full(), data, mode, count);
+        data.sdata += data.sdata;
+        data.sdata += data.sdata;
+        measure("packing inner with 256 char string from raw", pack_little_full(), data, mode, count);
+
+        // simple inner measurements.
+        data.msg.mutable_ldata()->set_third("K");
+        measure("packing inner with 1 char string from packed", pack_little(), data, mode, count);
+        data.msg.mutable_ldata()->set_third("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+        measure("packing inner with 64 char string from packed", pack_little(), data, mode, count);
+        data.msg.mutable_ldata()->set_third(data.sdata);
+        measure("packing inner with 256 char string from packed", pack_little(), data, mode, count);
+     */  
+        // complex measurements.
+        benchmark("complex straight-up", pack_complex(), data, mode, count, &report);
+    }
+    if (wire) { measure_file_proto(mode, count, &report); }
+    if (calls) { measure_calls(mode, count, &report); }
+
+    if (!report.Write()) {
+        std::cerr << "could not write the results.\n";
+        return 1;
+    }
     return 0;
 }
@@ -4,9 +4,34 @@
 #ifndef MEASURE_H
 #define MEASURE_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <vector>
 #include "clocker.h"
+#include "perf_counters.h"
+#include "report.h"
+
+// keeps the compiler from discarding value, or the work that produced it,
+// as unused. costs no instructions.
+template <class T> inline void do_not_optimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// makes the compiler assume all memory may be read and written here, so
+// stores before it happen and loads after it are not hoisted out of a loop.
+inline void clobber_memory() {
+    asm volatile("" : : : "memory");
+}
+
+// how many times operator new has been called. it only moves in a program
+// that replaces operator new with one that bumps it, as marshalling does.
+inline std::atomic<long>& allocation_count() {
+    static std::atomic<long> count(0);
+    return count;
+}
 
 // template for running and measuring tests.
 template <class Predicate, class Data> class clock_runner {
@@ -27,6 +52,22 @@ public:
         
         return clk.difference() / count;
     }
+
+    // times each run on its own into samples, and returns the average.
+    long run(int count, clocker::mode m, Histogram* samples) {
+        clocker clk(m);
+        long total = 0;
+
+        for (int i = 0; i < count; ++i) {
+            clk.begin();
+            _pred.run(_data);
+            clk.end();
+            samples->Record(clk.difference());
+            total += clk.difference();
+        }
+
+        return total / count;
+    }
     
 private:
     Predicate _pred;
@@ -34,13 +75,198 @@ private:
 };
 
 
-// template executor that also prints a message.
-template <class Predicate, class Data> void measure(std::string txt, Predicate pred, Data d, clocker::mode mode, int count) {
+// how bench_runner takes its samples.
+struct bench_options {
+    // how long to run before sampling, to warm caches and branch predictors.
+    long warmup_ns;
+    // iterations per sample. 0 picks the smallest power of two that makes a
+    // sample last at least sample_ns, so clock resolution and overhead are
+    // small beside it.
+    long iterations;
+    long sample_ns;
+    int samples;
+    // read cycles, instructions and cache misses per iteration as well.
+    bool counters;
+    // report allocations per iteration, from allocation_count().
+    bool allocations;
+
+    bench_options() : warmup_ns(50000000), iterations(0), sample_ns(2000000), samples(30),
+      counters(false), allocations(false) { }
+};
+
+// what bench_runner measured. times are nanoseconds per iteration, with
+// the timer's own overhead taken out of each sample.
+struct bench_stats {
+    long iterations;
+    long overhead;
+    std::vector<double> samples;
+    double median;
+    // median absolute deviation from the median; unlike a standard
+    // deviation, one preempted sample does not blow it up.
+    double mad;
+    // 95% confidence interval of the median.
+    double ci_low;
+    double ci_high;
+    bool counters;
+    double cycles;
+    double instructions;
+    double cache_misses;
+    double allocations;
+};
+
+// runs a predicate the way clock_runner does, but warms it up, calibrates
+// the iteration count and takes repeated samples, so that each result is a
+// median with an error bar instead of one cold measurement.
+template <class Predicate, class Data> class bench_runner {
+public:
+
+    bench_runner(const Predicate& p, const Data& d) : _pred(p), _data(d) { }
+
+    bench_stats run(const bench_options& options, clocker::mode m) {
+        clocker clk(m);
+        clk.begin();
+        do {
+            run_batch(1);
+            clk.end();
+        } while (clk.difference() < options.warmup_ns);
+
+        long iterations = options.iterations;
+        if (iterations <= 0) {
+            for (iterations = 1; iterations < (1L << 30); iterations *= 2) {
+                clk.begin();
+                run_batch(iterations);
+                clk.end();
+                if (clk.difference() >= options.sample_ns) { break; }
+            }
+        }
+
+        bench_stats stats;
+        stats.iterations = iterations;
+        stats.overhead = clocker::overhead(m);
+        perf_counters counters;
+        stats.counters = options.counters && counters.available();
+        long totals[perf_counters::event_count] = { };
+        stats.samples.reserve(std::max(options.samples, 1));
+        long allocations = allocation_count().load();
+        for (int i = 0; i < std::max(options.samples, 1); ++i) {
+            if (stats.counters) { counters.begin(); }
+            clk.begin();
+            run_batch(iterations);
+            clk.end();
+            if (stats.counters) {
+                counters.end();
+                for (int e = 0; e < perf_counters::event_count; ++e) {
+                    totals[e] += counters.count((perf_counters::event)e);
+                }
+            }
+            long time = std::max(clk.difference() - stats.overhead, 0L);
+            stats.samples.push_back((double)time / iterations);
+        }
+
+        double runs = (double)iterations * stats.samples.size();
+        stats.allocations = (allocation_count().load() - allocations) / runs;
+        stats.cycles = totals[perf_counters::cycles] / runs;
+        stats.instructions = totals[perf_counters::instructions] / runs;
+        stats.cache_misses = totals[perf_counters::cache_misses] / runs;
+        summarize(&stats);
+        return stats;
+    }
+
+private:
+    inline void run_batch(long iterations) {
+        for (long i = 0; i < iterations; ++i) {
+            _pred.run(_data);
+            do_not_optimize(_data);
+        }
+    }
+
+    static double median_of(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        size_t n = values.size();
+        return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    }
+
+    // the confidence interval uses order statistics, which hold whatever the
+    // distribution of the samples is.
+    static void summarize(bench_stats* stats) {
+        std::vector<double> sorted = stats->samples;
+        std::sort(sorted.begin(), sorted.end());
+        stats->median = median_of(sorted);
+        std::vector<double> deviations;
+        for (double sample : sorted) { deviations.push_back(std::fabs(sample - stats->median)); }
+        stats->mad = median_of(deviations);
+
+        double n = sorted.size();
+        double spread = 1.96 * std::sqrt(n) / 2;
+        long low = std::max(0L, (long)std::floor(n / 2 - spread) - 1);
+        long high = std::min((long)n - 1, (long)std::ceil(n / 2 + spread));
+        stats->ci_low = sorted[low];
+        stats->ci_high = sorted[high];
+    }
+
+    Predicate _pred;
+    Data _data;
+};
+
+// template executor for bench_runner, which prints the median, its spread
+// and interval, and the iterations per sample, and adds the samples to the
+// report if it is writing results. d is copied once, into the runner.
+template <class Predicate, class Data> bench_stats benchmark(std::string txt, const Predicate& pred, const Data& d, clocker::mode mode, const bench_options& options, Report* report = nullptr) {
+    std::string name = txt;
+    if (txt.length() > 60) { txt = txt.substr(0, 60); }
+    std::cout << std::left << std::setw(60) << std::setfill(' ') << txt << std::flush;
+
+    bench_runner<Predicate, Data> runner(pred, d);
+    bench_stats stats = runner.run(options, mode);
+
+    std::cout << std::fixed << std::setprecision(1) << stats.median << " +- " << stats.mad
+      << " [" << stats.ci_low << ", " << stats.ci_high << "] x" << stats.iterations;
+    if (stats.counters) {
+        std::cout << " cycles " << stats.cycles << " instructions " << stats.instructions
+          << " cache misses " << std::setprecision(3) << stats.cache_misses;
+    } else if (options.counters) {
+        std::cout << " (no perf counters)";
+    }
+    if (options.allocations) {
+        std::cout << " allocs " << std::setprecision(2) << stats.allocations;
+    }
+    std::cout << std::endl;
+
+    if (report != nullptr && report->IsEnabled()) {
+        Report::Entry* entry = report->Add(name);
+        for (double sample : stats.samples) { entry->distribution.Record(std::lround(sample)); }
+        entry->metrics.push_back(std::make_pair("median", stats.median));
+        entry->metrics.push_back(std::make_pair("mad", stats.mad));
+        entry->metrics.push_back(std::make_pair("ci_low", stats.ci_low));
+        entry->metrics.push_back(std::make_pair("ci_high", stats.ci_high));
+        entry->metrics.push_back(std::make_pair("iterations", (double)stats.iterations));
+        if (stats.counters) {
+            entry->metrics.push_back(std::make_pair("cycles", stats.cycles));
+            entry->metrics.push_back(std::make_pair("instructions", stats.instructions));
+            entry->metrics.push_back(std::make_pair("cache_misses", stats.cache_misses));
+        }
+        if (options.allocations) {
+            entry->metrics.push_back(std::make_pair("allocations", stats.allocations));
+        }
+    }
+    return stats;
+}
+
+// template executor that also prints a message. with a report that is
+// writing results, every run is timed separately and its distribution is
+// added to the report under txt.
+template <class Predicate, class Data> void measure(std::string txt, Predicate pred, Data d, clocker::mode mode, int count, Report* report = nullptr) {
+    std::string name = txt;
     if (txt.length() > 60) { txt = txt.substr(0, 60); }
     std::cout << std::left << std::setw(60) << std::setfill(' ') << txt;
     
     clock_runner<Predicate, Data> runner(pred, d);
-    long time = runner.run(count, mode);
+    long time;
+    if (report != nullptr && report->IsEnabled()) {
+        time = runner.run(count, mode, &report->Add(name)->distribution);
+    } else {
+        time = runner.run(count, mode);
+    }
     
     std::cout << time << std::endl;
 }
@@ -0,0 +1,80 @@
+// perf_counters.h : hardware event counters for the benchmark harness.
+// by: allison morris
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// counts cpu cycles, instructions retired and last-level cache misses of
+// this thread, in user space only, through perf_event_open. the three are
+// one group, so they are always counted over exactly the same stretch of
+// time. where perf events are not allowed (a container, or a
+// perf_event_paranoid above 2) available() is false and every count is 0.
+class perf_counters {
+public:
+    enum event { cycles, instructions, cache_misses, event_count };
+
+    perf_counters() : _counts() {
+        static const unsigned long configs[event_count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+        };
+        for (int i = 0; i < event_count; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            _fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : _fds[0], 0);
+            if (_fds[i] < 0) {
+                close_all(i);
+                return;
+            }
+        }
+    }
+
+    ~perf_counters() { close_all(available() ? event_count : 0); }
+
+    bool available() const { return _fds[0] >= 0; }
+
+    // the count of e between the last begin() and end().
+    long count(event e) const { return _counts[e]; }
+
+    inline void begin() {
+        if (!available()) { return; }
+        ioctl(_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    inline void end() {
+        if (!available()) { return; }
+        ioctl(_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // a group read is the number of events followed by each count.
+        unsigned long values[1 + event_count];
+        if (read(_fds[0], values, sizeof(values)) == (ssize_t)sizeof(values)) {
+            for (int i = 0; i < event_count; ++i) { _counts[i] = values[1 + i]; }
+        }
+    }
+
+private:
+    perf_counters(const perf_counters&);
+    perf_counters& operator=(const perf_counters&);
+
+    void close_all(int opened) {
+        for (int i = 0; i < opened; ++i) { ::close(_fds[i]); }
+        for (int i = 0; i < event_count; ++i) { _fds[i] = -1; }
+    }
+
+    int _fds[event_count];
+    long _counts[event_count];
+};
+
+#endif
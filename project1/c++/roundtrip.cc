@@ -3,8 +3,9 @@
 
 #include "basic_service.h"
 #include "measure.h"
+#include <cstdlib>
 
-int run_client(std::string);
+int run_client(std::string, int, Report*);
 int run_server(std::string);
 
 // data to be passed to measurement functions.
@@ -23,7 +24,14 @@ struct roundtrip {
     }
 };
 
+// usage: roundtrip [--json file | --csv file] SERVER|CLIENT address [count]
+// count is the number of echoes per sample.
 int main(int argc, char** argv) {
+    Report report;
+    if (!report.ParseOption(&argc, &argv)) {
+        std::cerr << "--json and --csv need a file to write the results to.\n";
+        return 1;
+    }
     if (argc < 3) {
         std::cerr << "Need SERVER or CLIENT followed by ADDRESS.\n";
         return 1;
@@ -33,7 +41,13 @@ int main(int argc, char** argv) {
     if (mode == "SERVER") {
         return run_server(argv[2]); 
     } else if (mode == "CLIENT") {
-        return run_client(argv[2]);
+        int count = argc > 3 ? atoi(argv[3]) : 15;
+        int ret = run_client(argv[2], count > 0 ? count : 15, &report);
+        if (ret == 0 && !report.Write()) {
+            std::cerr << "could not write the results.\n";
+            return 1;
+        }
+        return ret;
     } else {
         std::cerr << "Need SERVER or CLIENT followed by ADDRESS.\n";
         return 1;
@@ -43,16 +57,17 @@ int main(int argc, char** argv) {
 
 
 // runs the client side of the test.
-int run_client(std::string address) {
+int run_client(std::string address, int count, Report* report) {
     std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(address, grpc::InsecureCredentials());
     std::shared_ptr<basic_service::Stub> stub = basic_service::NewStub(channel);
     clocker::mode mode = clocker::clock_gettime;
-    int count = 15;    
 
     message_data data;
     data.request.set_data(13);
     data.stub = stub.get();
-    measure("Average echo time", roundtrip(), data, mode, count);
+    bench_options options;
+    options.iterations = count;
+    benchmark("Average echo time", roundtrip(), data, mode, options, report);
     
     return 0;
 }
@@ -0,0 +1,87 @@
+// admission_control.cc : implements AdmissionControl.
+// by: allison morris
+
+#include <algorithm>
+#include <ctime>
+#include "admission_control.h"
+
+using namespace File;
+
+const long AdmissionControl::kDefaultByteLimit;
+const long AdmissionControl::kMinRetryMs;
+const long AdmissionControl::kMaxRetryMs;
+
+void AdmissionControl::Ticket::Release() {
+  if (control_ != nullptr) {
+    control_->Release(this);
+    control_ = nullptr;
+  }
+}
+
+AdmissionControl::AdmissionControl(long byte_limit)
+    : bytes_(0), byte_limit_(byte_limit), client_byte_limit_(byte_limit / 4)
+    , uploads_(0), upload_limit_(64), client_upload_limit_(16), rejected_(0)
+    , hold_ms_(kMinRetryMs) { }
+
+long AdmissionControl::Admit(const std::string& peer, long bytes, bool upload,
+    Ticket* ticket) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Client& client = clients_[peer];
+  bool over = (bytes_ > 0 && bytes_ + bytes > byte_limit_) ||
+    (client.bytes > 0 && client.bytes + bytes > client_byte_limit_) ||
+    (upload && (uploads_ >= upload_limit_ || client.uploads >= client_upload_limit_));
+  if (over) {
+    if (client.bytes == 0 && client.uploads == 0) { clients_.erase(peer); }
+    ++rejected_;
+    return std::min(std::max(hold_ms_, kMinRetryMs), kMaxRetryMs);
+  }
+
+  bytes_ += bytes;
+  client.bytes += bytes;
+  if (upload) {
+    ++uploads_;
+    ++client.uploads;
+  }
+  ticket->Release();
+  ticket->control_ = this;
+  ticket->peer_ = peer;
+  ticket->bytes_ = bytes;
+  ticket->upload_ = upload;
+  ticket->start_ = GetTimeMs();
+  return 0;
+}
+
+long AdmissionControl::GetTimeMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+AdmissionControl::Usage AdmissionControl::GetUsage() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Usage usage;
+  usage.bytes = bytes_;
+  usage.byte_limit = byte_limit_;
+  usage.client_byte_limit = client_byte_limit_;
+  usage.uploads = uploads_;
+  usage.upload_limit = upload_limit_;
+  usage.client_upload_limit = client_upload_limit_;
+  usage.clients = clients_.size();
+  usage.rejected = rejected_;
+  return usage;
+}
+
+void AdmissionControl::Release(Ticket* ticket) {
+  long held = GetTimeMs() - ticket->start_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  hold_ms_ = (hold_ms_ * 7 + held) / 8;
+  bytes_ -= ticket->bytes_;
+  auto iter = clients_.find(ticket->peer_);
+  Client& client = iter->second;
+  client.bytes -= ticket->bytes_;
+  if (ticket->upload_) {
+    --uploads_;
+    --client.uploads;
+  }
+  if (client.bytes == 0 && client.uploads == 0) { clients_.erase(iter); }
+}
@@ -0,0 +1,103 @@
+// admission_control.h : declares AdmissionControl, which bounds the memory
+// held by requests in flight.
+// by: allison morris
+
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace File {
+
+// counts the request bytes each client has in flight (an upload's body, a
+// download's file or current chunk) and the uploads being staged, against
+// server-wide and per-client limits. a request that would go over a limit is
+// refused with a suggested retry delay instead of queued, so an upload burst
+// costs the server a bounded amount of memory rather than all of it.
+//
+// a request larger than a limit is still let through when its client, or
+// the server, has nothing else in flight, so that big files are slowed down
+// rather than refused forever.
+//
+// an upload's body has been received by the time it is admitted here, so
+// filed also holds grpc's receive buffers to the same limit; see filed.cc.
+class AdmissionControl {
+public:
+  static const long kDefaultByteLimit = 512L << 20;
+  static const long kMinRetryMs = 10;
+  static const long kMaxRetryMs = 5000;
+
+  struct Usage {
+    long bytes;
+    long byte_limit;
+    long client_byte_limit;
+    int uploads;
+    int upload_limit;
+    int client_upload_limit;
+    int clients;
+    long rejected;
+  };
+
+  // holds what one request was admitted with and gives it back on
+  // destruction.
+  class Ticket {
+  public:
+    Ticket() : control_(nullptr), bytes_(0), upload_(false), start_(0) { }
+
+    ~Ticket() { Release(); }
+
+    void Release();
+  private:
+    friend class AdmissionControl;
+
+    Ticket(const Ticket&);
+    Ticket& operator=(const Ticket&);
+
+    AdmissionControl* control_;
+    std::string peer_;
+    long bytes_;
+    bool upload_;
+    long start_;
+  };
+
+  // byte_limit is the server-wide limit; each client may use a quarter of
+  // it. uploads are limited to 64 at once, 16 per client.
+  explicit AdmissionControl(long byte_limit = kDefaultByteLimit);
+
+  // reserves bytes, and a staging slot if upload is set, for peer. returns 0
+  // and fills ticket on success, or the number of milliseconds after which
+  // the client should try again.
+  long Admit(const std::string& peer, long bytes, bool upload, Ticket* ticket);
+
+  Usage GetUsage();
+private:
+  struct Client {
+    long bytes;
+    int uploads;
+
+    Client() : bytes(0), uploads(0) { }
+  };
+
+  static long GetTimeMs();
+
+  void Release(Ticket* ticket);
+
+  std::mutex mutex_;
+  std::map<std::string, Client> clients_;
+  long bytes_;
+  long byte_limit_;
+  long client_byte_limit_;
+  int uploads_;
+  int upload_limit_;
+  int client_upload_limit_;
+  long rejected_;
+  // moving average of how long admitted requests hold their reservation,
+  // which is about how long a refused client has to wait.
+  long hold_ms_;
+};
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <iostream>
 #include "arguments.h"
+#include "request_scheduler.h"
 
 using namespace File;
 
@@ -37,14 +38,21 @@ Arguments::StateType Arguments::Parse(const char* arg, StateType current_state,
 	}
         switch (arg[1]) {
 	  case 'h': show_help_ = true; return kReady;
+	  case 'A': arenas_ = true; return kReady;
+	  case 'B': data_plane_ = true; return kReady;
 	  case 'p': return kReadPort;
+	  case 'M': return kReadMemoryLimit;
+	  case 'S': return kReadBulkSlots;
 	  case 'D': return kReadPersistentDir;
 	  case 'P': return kReadPersistentStore;
+	  case 'R': return kReadTraceFile;
 	  case 'V': return kReadVerbosity;
 	  case 'd': dump_files_ = true; return kReady;
 	  case 'q': verbosity_ = kFatal; return kReady;
 	  case 'L': verbosity_ = kTrace; return kReady;
 	  case 'c': crash_write_ = true; return kReady;
+	  case 'T': tmpfile_staging_ = true; return kReady;
+	  case 'U': uring_io_ = true; return kReady;
 	  default: errors_.push_back(kInvalidOption); return kReady;
 	}
       }
@@ -66,9 +74,31 @@ Arguments::StateType Arguments::Parse(const char* arg, StateType current_state,
       port_ = port;
       return kReady;
     } break;
+    case kReadBulkSlots: {
+      char* end_ptr;
+      long slots = std::strtol(arg, &end_ptr, 10);
+      if (*end_ptr != 0 || slots < RequestScheduler::kMinBulkSlots || slots > 1024) {
+        errors_.push_back(kIllegalBulkSlots);
+	return kReady;
+      }
+
+      bulk_slots_ = slots;
+      return kReady;
+    } break;
     case kReadCacheDir: {
       assert(IsClient());
     } break;
+    case kReadMemoryLimit: {
+      char* end_ptr;
+      long limit = std::strtol(arg, &end_ptr, 10);
+      if (*end_ptr != 0 || limit <= 0) {
+        errors_.push_back(kIllegalMemoryLimit);
+	return kReady;
+      }
+
+      memory_limit_ = limit;
+      return kReady;
+    } break;
     case kReadPersistentDir: {
       persistent_directory_ = arg;
       return kReady;
@@ -77,6 +107,10 @@ Arguments::StateType Arguments::Parse(const char* arg, StateType current_state,
       persistent_store_name_ = arg;
       return kReady;
     } break;
+    case kReadTraceFile: {
+      trace_file_ = arg;
+      return kReady;
+    } break;
     case kReadVerbosity: {
       char* end_ptr;
       int verbosity = std::strtol(arg, &end_ptr, 10);
@@ -100,6 +134,8 @@ bool Arguments::ShowError() const {
   for (auto err : errors_) {
     std::cout << GetExecutable() << ": ";
     switch (err) {
+      case kIllegalBulkSlots: std::cout << "illegal bulk slots. must be in [2, 1024]."; break;
+      case kIllegalMemoryLimit: std::cout << "illegal memory limit. must be positive."; break;
       case kIllegalPort: std::cout << "illegal port. must be in [0, 65535]."; break;
       case kIllegalVerbosity: std::cout << "illegal verbosity. must be in [0, 4]."; break;
       case kInvalidOption:
@@ -127,13 +163,21 @@ bool Arguments::ShowHelp() const {
   } else {
     std::cout << "Usage: " << GetExecutable() << " [options] mount_point\nOptions:\n"
       "    -h     Display this message.\n"
+      "    -A     Build streamed chunks on per-call arenas with recycled buffers.\n"
+      "    -B     Serve raw reads, without protobuf, on the generic data plane.\n"
       "    -p n   Listen on port n for client connections.\n"
+      "    -M n   Refuse requests past n megabytes in flight. Default is 512.\n"
+      "    -S n   Let n uploads and downloads do file i/o at once. Default is one\n"
+      "           fewer than the cpus, and at least 2.\n"
       "    -D s   Use s as the cache directory. This is called the persistent directory.\n"
       "    -P s   Use s as the location of the persistent store log.\n"
+      "    -R s   Record a trace of client calls to s, for the tester's Replay mode.\n"
       "    -V n   Set verbosity to level n. Levels are [0, 4]. Default is 1.\n"
       "    -d     Dump file contents to logs.\n"
       "    -q     Set verbosity to minimum. Disable all logging excepts errors.\n"
-      "    -L     Set verbosity to maximum.\n";
+      "    -L     Set verbosity to maximum.\n"
+      "    -T     Stage uploads as O_TMPFILE files in the target directory.\n"
+      "    -U     Use io_uring for file i/o instead of blocking system calls.\n";
   }
   std::cout << std::endl;
   return true;
@@ -13,6 +13,8 @@ class Arguments {
 public:
   enum ErrorType {
       kIllegalPort
+    , kIllegalBulkSlots
+    , kIllegalMemoryLimit
     , kIllegalVerbosity
     , kInvalidOption
     , kMissingMountPoint
@@ -23,18 +25,27 @@ public:
   enum StateType {
       kReady
     , kReadPort
+    , kReadBulkSlots
     , kReadCacheDir
+    , kReadMemoryLimit
     , kReadPersistentDir
     , kReadPersistentStore
+    , kReadTraceFile
     , kReadVerbosity
   };
 
   Arguments(ModeType mode)
     : mode_(mode)
     , port_(61512)
+    , arenas_(false)
+    , bulk_slots_(0)
+    , data_plane_(false)
+    , memory_limit_(512)
     , crash_write_(false)
     , dump_files_(false)
     , show_help_(false)
+    , tmpfile_staging_(false)
+    , uring_io_(false)
     , fuse_args_(2)
     , verbosity_(kInfo)
     , server_name_("localhost")
@@ -43,8 +54,16 @@ public:
     , persistent_store_name_("filed-log")
     { }
 
+  bool GetArenas() const { return arenas_; }
+
+  // how many bulk requests may do file i/o at once, or 0 for the default.
+  int GetBulkSlots() const { return bulk_slots_; }
+
   const std::string& GetCacheDirectory() const { return cache_directory_; }
 
+  // whether to serve raw reads through the DataPlane as well.
+  bool GetDataPlane() const { return data_plane_; }
+
   const std::string& GetExecutable() const { return executable_; }
 
   bool GetCrashWrite() const { return crash_write_; }
@@ -53,6 +72,9 @@ public:
 
   int GetFuseArgs() const { return fuse_args_; }
 
+  // the limit on bytes held by requests in flight, in megabytes.
+  long GetMemoryLimit() const { return memory_limit_; }
+
   const std::string& GetMountPoint() const { return mount_point_; }
 
   const std::string& GetPersistentDirectory() const { return persistent_directory_; }
@@ -63,6 +85,13 @@ public:
 
   const std::string& GetServerName() const { return server_name_; }
 
+  bool GetTmpFileStaging() const { return tmpfile_staging_; }
+
+  // where to record a trace of client calls, or empty for none.
+  const std::string& GetTraceFile() const { return trace_file_; }
+
+  bool GetUringIo() const { return uring_io_; }
+
   LogLevel GetVerbosity() const { return verbosity_; }
 
   bool IsClient() const { return mode_ == kClient; }
@@ -81,9 +110,15 @@ private:
 
   const ModeType mode_;
   int port_;
+  bool arenas_;
+  int bulk_slots_;
+  bool data_plane_;
+  long memory_limit_;
   bool crash_write_;
   bool dump_files_;
   bool show_help_;
+  bool tmpfile_staging_;
+  bool uring_io_;
   int fuse_args_;
   LogLevel verbosity_;
   std::string server_name_;
@@ -92,6 +127,7 @@ private:
   std::string executable_;
   std::string persistent_directory_;
   std::string persistent_store_name_;
+  std::string trace_file_;
   std::list<ErrorType> errors_;
 };
 
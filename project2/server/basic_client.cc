@@ -3,7 +3,10 @@
 
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <vector>
 #include "file_service.h"
+#include "sha256.h"
 
 using namespace File;
 using grpc::Channel;
@@ -16,6 +19,69 @@ public:
   FileStub(std::shared_ptr<Channel> channel) 
     : rpc_(BasicFileService::NewStub(channel)) { }
 
+  // sends every line of script, formatted like the shell's commands (mkdir,
+  // mknod, put, rm, rmdir), as one batch. results receives each error code.
+  // an atomic batch commits all or nothing, but committed operations can
+  // still fail one by one, so every code needs checking.
+  bool Batch(std::istream& script, bool atomic, std::vector<int>* results) {
+    BatchRequest request;
+    BatchReply reply;
+    ClientContext ctx;
+    request.set_atomic(atomic);
+    std::string line;
+    while (std::getline(script, line)) {
+      size_t space = line.find_first_of(' ');
+      if (space == std::string::npos) { continue; }
+      std::string name = line.substr(0, space);
+      BatchOp* op = request.add_ops();
+      op->set_path(line.substr(space + 1));
+      if (name == "mkdir") {
+        op->set_type(BatchOp::MKDIR);
+      } else if (name == "mknod") {
+        op->set_type(BatchOp::CREATE);
+      } else if (name == "put") {
+        op->set_type(BatchOp::UPLOAD);
+        std::ifstream src(op->path());
+        op->mutable_contents()->assign(std::istreambuf_iterator<char>(src),
+          std::istreambuf_iterator<char>());
+      } else if (name == "rm") {
+        op->set_type(BatchOp::REMOVE);
+      } else if (name == "rmdir") {
+        op->set_type(BatchOp::RMDIR);
+      } else {
+        std::cout << "Unknown batch command: " << name << "\n";
+        return false;
+      }
+    }
+    Status status = rpc_->Batch(&ctx, request, &reply);
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for Batch\n";
+      return false;
+    }
+
+    for (const Result& result : reply.results()) {
+      results->push_back(result.error_code());
+    }
+    return true;
+  }
+
+  bool Copy(const std::string& from, const std::string& to) {
+    CopyRequest request;
+    FileInfo response;
+    ClientContext ctx;
+    request.set_from(from);
+    request.set_to(to);
+    Status status = rpc_->Copy(&ctx, request, &response);
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for Copy\n";
+      return false;
+    }
+
+    return response.error_code() == 0;
+  }
+
   bool CreateDirectory(const std::string& path) {
     Path request;
     Result response;
@@ -64,6 +130,52 @@ public:
     return true;
   }
 
+  // like DownloadFile, but receives the file as a stream of chunks. a
+  // stream that breaks is resumed from where it stopped, reading the same
+  // version of the file that it started on.
+  bool DownloadFileStream(const std::string& path, std::ostream* dest) {
+    static const int kMaxResumes = 3;
+    Path request;
+    FileChunk chunk;
+    ClientContext ctx;
+    request.set_data(path);
+    std::unique_ptr<grpc::ClientReader<FileChunk>> reader =
+      rpc_->DownloadFileStream(&ctx, request);
+
+    bool good = true;
+    uint64_t version = 0;
+    uint64_t received = 0;
+    while (reader->Read(&chunk)) {
+      if (chunk.has_info() && chunk.info().error_code() != 0) { good = false; }
+      if (chunk.has_info()) { version = chunk.info().version(); }
+      dest->write(chunk.contents().c_str(), chunk.contents().size());
+      received += chunk.contents().size();
+    }
+    Status status = reader->Finish();
+
+    for (int i = 0; i < kMaxResumes && !status.ok() && good && version != 0; ++i) {
+      ReadRequest range;
+      ClientContext range_ctx;
+      range.set_path(path);
+      range.set_version(version);
+      range.set_offset(received);
+      reader = rpc_->DownloadRange(&range_ctx, range);
+      while (reader->Read(&chunk)) {
+        if (chunk.has_info() && chunk.info().error_code() != 0) { good = false; }
+        dest->write(chunk.contents().c_str(), chunk.contents().size());
+        received += chunk.contents().size();
+      }
+      status = reader->Finish();
+    }
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for DownloadFileStream\n";
+      return false;
+    }
+
+    return good;
+  }
+
   // gets the contents of directory path and stores them in the store referenced by i.
   // Iterator supports dereferenced-write operations of type std::string.
   template <class Iterator> bool GetDirectoryContents(const std::string& path, Iterator i) {
@@ -105,6 +217,38 @@ public:
     return true;
   }
 
+  // gets the server's hash of path, which is empty if it has none.
+  bool GetFileHash(const std::string& path, std::string* digest) {
+    Path request;
+    FileInfo reply;
+    ClientContext ctx;
+    request.set_data(path);
+    Status status = rpc_->GetFileInfo(&ctx, request, &reply);
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for GetFileInfo\n";
+      return false;
+    }
+
+    if (reply.error_code() != 0) { return false; }
+
+    *digest = reply.sha256();
+    return true;
+  }
+
+  bool GetServerStats(ServerStats* stats) {
+    StatsRequest request;
+    ClientContext ctx;
+    Status status = rpc_->GetServerStats(&ctx, request, stats);
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for GetServerStats\n";
+      return false;
+    }
+
+    return true;
+  }
+
   bool RemoveDirectory(const std::string& path) {
     Path request;
     Result response;
@@ -135,6 +279,22 @@ public:
     return response.error_code() == 0;
   }
 
+  bool Rename(const std::string& from, const std::string& to) {
+    RenameRequest request;
+    Result response;
+    ClientContext ctx;
+    request.set_from(from);
+    request.set_to(to);
+    Status status = rpc_->Rename(&ctx, request, &response);
+
+    if (!status.ok()) {
+      std::cout << "RPC failed for Rename\n";
+      return false;
+    }
+
+    return response.error_code() == 0;
+  }
+
   bool UploadFile(const std::string& path, std::istream& src) {
     FileData request;
     FileInfo reply;
@@ -188,6 +348,31 @@ int main(int argc, const char** argv) {
       continue;
     }
 
+    if (cmd_name == "batch" || cmd_name == "abatch") {
+      std::ifstream script(cmd_arg);
+      std::vector<int> results;
+      if (!stub.Batch(script, cmd_name == "abatch", &results)) {
+        std::cout << "Could not run batch: " << cmd_arg << "\n";
+        continue;
+      }
+      int failed = 0;
+      for (int err : results) { failed += err != 0; }
+      std::cout << "ran " << results.size() << " operations, " << failed << " failed\n";
+      continue;
+    }
+
+    if (cmd_name == "cp") {
+      size_t split = cmd_arg.find_first_of(' ');
+      std::string from = cmd_arg.substr(0, split);
+      std::string to = split == std::string::npos ? std::string() : cmd_arg.substr(split + 1);
+      if (!stub.Copy(from, to)) {
+        std::cout << "could not copy " << from << " to " << to << "\n";
+        continue;
+      }
+      std::cout << "copied " << from << " to " << to << "\n";
+      continue;
+    }
+
     if (cmd_name == "get") {
       std::fstream stream(cmd_arg, std::ios::out);
       if (!stub.DownloadFile(cmd_arg, &stream)) {
@@ -198,6 +383,16 @@ int main(int argc, const char** argv) {
       continue;
     }
 
+    if (cmd_name == "sget") {
+      std::fstream stream(cmd_arg, std::ios::out);
+      if (!stub.DownloadFileStream(cmd_arg, &stream)) {
+        std::cout << "Could not download file: " << cmd_arg << "\n";
+        continue;
+      }
+      std::cout << "Downloaded " << cmd_arg << "\n";
+      continue;
+    }
+
     if (cmd_name == "info") {
       long modification_time;
       if (!stub.GetFileInfo(cmd_arg, &modification_time)) {
@@ -209,6 +404,30 @@ int main(int argc, const char** argv) {
       continue;
     }
 
+    if (cmd_name == "stats") {
+      ServerStats stats;
+      if (!stub.GetServerStats(&stats)) {
+        std::cout << "Could not get server stats\n";
+        continue;
+      }
+      std::cout << "in flight: " << stats.in_flight_bytes() << " / "
+        << stats.in_flight_byte_limit() << " bytes, " << stats.staged_uploads() << " / "
+        << stats.staged_upload_limit() << " uploads, " << stats.active_clients()
+        << " clients, " << stats.rejected_requests() << " rejected\n";
+      continue;
+    }
+
+    if (cmd_name == "sum") {
+      std::string digest;
+      if (!stub.GetFileHash(cmd_arg, &digest)) {
+        std::cout << "Could not get file info: " << cmd_arg << "\n";
+        continue;
+      }
+      std::cout << (digest.empty() ? "unknown" : Sha256::ToHex(digest)) << "  " << cmd_arg
+        << "\n";
+      continue;
+    }
+
     if (cmd_name == "ls") {
       std::list<std::string> contents;
       if (!stub.GetDirectoryContents(cmd_arg, std::back_inserter(contents))) {
@@ -240,6 +459,18 @@ int main(int argc, const char** argv) {
       continue;
     }
 
+    if (cmd_name == "mv") {
+      size_t split = cmd_arg.find_first_of(' ');
+      std::string from = cmd_arg.substr(0, split);
+      std::string to = split == std::string::npos ? std::string() : cmd_arg.substr(split + 1);
+      if (!stub.Rename(from, to)) {
+        std::cout << "could not rename " << from << " to " << to << "\n";
+	continue;
+      }
+      std::cout << "renamed " << from << " to " << to << "\n";
+      continue;
+    }
+
     if (cmd_name == "put") {
       std::fstream stream(cmd_arg, std::ios::in);
       if (!stub.UploadFile(cmd_arg, stream)) {
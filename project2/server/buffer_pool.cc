@@ -0,0 +1,58 @@
+// buffer_pool.cc : implements BufferPool and CallArena.
+// by: allison morris
+
+#include "buffer_pool.h"
+
+using namespace File;
+
+const size_t BufferPool::kMaxCapacity;
+const size_t BufferPool::kMaxFree;
+const size_t CallArena::kBlockSize;
+
+BufferPool::Buffer::Buffer(size_t capacity) : pooled_(capacity != 0), lent_to_(nullptr) {
+  if (!pooled_) { return; }
+  std::vector<std::string>* free_list = GetFreeList();
+  if (!free_list->empty()) {
+    buffer_.swap(free_list->back());
+    free_list->pop_back();
+  }
+  // the last user's bytes must not reach the next one, say in the error
+  // chunk of a download; clearing keeps the capacity.
+  buffer_.clear();
+  buffer_.reserve(capacity);
+}
+
+BufferPool::Buffer::~Buffer() {
+  if (lent_to_ != nullptr) { lent_to_->swap(buffer_); }
+  if (!pooled_ || buffer_.capacity() > kMaxCapacity) { return; }
+  std::vector<std::string>* free_list = GetFreeList();
+  if (free_list->size() < kMaxFree) {
+    free_list->push_back(std::string());
+    free_list->back().swap(buffer_);
+  }
+}
+
+void BufferPool::Buffer::Lend(std::string* target) {
+  target->swap(buffer_);
+  lent_to_ = target;
+}
+
+std::vector<std::string>* BufferPool::GetFreeList() {
+  static thread_local std::vector<std::string> free_list;
+  return &free_list;
+}
+
+CallArena::CallArena(bool enabled)
+    : enabled_(enabled), block_(enabled ? kBlockSize : 0)
+    , arena_(GetOptions(enabled, &block_)) { }
+
+google::protobuf::ArenaOptions CallArena::GetOptions(bool enabled,
+    BufferPool::Buffer* block) {
+  google::protobuf::ArenaOptions options;
+  if (enabled) {
+    block->Get()->resize(kBlockSize);
+    options.initial_block = &(*block->Get())[0];
+    options.initial_block_size = kBlockSize;
+  }
+  return options;
+}
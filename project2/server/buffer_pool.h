@@ -0,0 +1,92 @@
+// buffer_pool.h : declares BufferPool, which recycles file body buffers, and
+// CallArena, which holds the messages one call builds.
+// by: allison morris
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/message.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace File {
+
+// a free list of byte buffers for each thread. a streamed download holds a
+// chunk-sized buffer for as long as it runs, and at 256k that is past
+// malloc's mmap threshold, so without the pool every call maps and unmaps
+// it and takes fresh page faults on the first chunk. grpc's sync server
+// runs a call start to finish on one thread, so the lists need no lock.
+class BufferPool {
+public:
+  // buffers bigger than this are freed instead of kept.
+  static const size_t kMaxCapacity = 4 << 20;
+  // how many buffers each thread keeps.
+  static const size_t kMaxFree = 4;
+
+  // a buffer taken from the calling thread's list and given back to it on
+  // destruction. it starts out empty, whatever its last user left in it,
+  // but keeps that user's capacity. asking for no capacity takes nothing
+  // from the pool, so callers can turn pooling off without a second code
+  // path.
+  class Buffer {
+  public:
+    explicit Buffer(size_t capacity);
+
+    ~Buffer();
+
+    std::string* Get() { return &buffer_; }
+
+    // swaps the buffer into target, which must outlive this object. it is
+    // swapped back out on destruction.
+    void Lend(std::string* target);
+  private:
+    Buffer(const Buffer&);
+    Buffer& operator=(const Buffer&);
+
+    bool pooled_;
+    std::string buffer_;
+    std::string* lent_to_;
+  };
+private:
+  static std::vector<std::string>* GetFreeList();
+};
+
+// the messages a call builds for itself, like the chunks of a streamed
+// download. when enabled they live on a protobuf arena whose first block
+// comes from the BufferPool, so building them costs no allocator calls
+// until the block runs out, and they are freed all at once when the call
+// ends. otherwise they are plain heap messages.
+class CallArena {
+public:
+  static const size_t kBlockSize = 64 * 1024;
+
+  explicit CallArena(bool enabled);
+
+  template <typename T>
+  T* Create() {
+    if (enabled_) { return google::protobuf::Arena::CreateMessage<T>(&arena_); }
+    T* message = new T;
+    owned_.emplace_back(message);
+    return message;
+  }
+
+  bool IsEnabled() const { return enabled_; }
+private:
+  CallArena(const CallArena&);
+  CallArena& operator=(const CallArena&);
+
+  static google::protobuf::ArenaOptions GetOptions(bool enabled, BufferPool::Buffer* block);
+
+  bool enabled_;
+  // declared before arena_, so that the arena is gone before its block
+  // goes back to the pool.
+  BufferPool::Buffer block_;
+  google::protobuf::Arena arena_;
+  std::vector<std::unique_ptr<google::protobuf::Message>> owned_;
+};
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+// buffer_pool_test.cc : checks that pooled buffers do not carry one call's
+// bytes into the next.
+// by: allison morris
+
+#include <iostream>
+#include <string>
+#include "buffer_pool.h"
+#include "file.pb.h"
+
+using namespace File;
+
+namespace {
+
+const size_t kChunkSize = 256 * 1024;
+
+// builds a chunk the way DownloadFileStream does under filed -A. a served
+// chunk gets contents; an error chunk only gets an error code, and returns
+// the contents it would have sent.
+std::string BuildChunk(bool served) {
+  CallArena arena(true);
+  FileChunk* chunk = arena.Create<FileChunk>();
+  BufferPool::Buffer body(kChunkSize);
+  body.Lend(chunk->mutable_contents());
+  if (served) {
+    chunk->mutable_contents()->assign("other-file!");
+  } else {
+    chunk->mutable_info()->set_error_code(-2);
+  }
+  return chunk->contents();
+}
+
+}
+
+int main() {
+  int failures = 0;
+  if (BuildChunk(true) != "other-file!") {
+    std::cout << "FAIL served chunk lost its contents\n";
+    ++failures;
+  }
+  std::string leaked = BuildChunk(false);
+  if (!leaked.empty()) {
+    std::cout << "FAIL error chunk after a served chunk holds " << leaked.size()
+      << " bytes: " << leaked.substr(0, 32) << "\n";
+    ++failures;
+  }
+  if (failures == 0) { std::cout << "OK buffer_pool_test\n"; }
+  return failures == 0 ? 0 : 1;
+}
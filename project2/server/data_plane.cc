@@ -0,0 +1,240 @@
+// data_plane.cc : implements DataPlane.
+// by: allison morris
+
+// every call is a small state machine driven by the completion queue. it
+// waits for a client, reads the request, then writes one chunk at a time,
+// reading the next only once grpc is done with the last, so a call holds at
+// most one chunk. reads go through FileService's resolver, descriptor cache
+// and version table, and are admitted against its limits, but skip its
+// scheduler, whose slots block a thread; the data plane has only a few.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/stat.h>
+#include "data_plane.h"
+#include "event_log.h"
+#include "file_service.h"
+
+using namespace File;
+
+const uint32_t DataPlane::kMagic;
+const size_t DataPlane::kRequestHeaderSize;
+const size_t DataPlane::kChunkHeaderSize;
+const size_t DataPlane::kChunkSize;
+const int DataPlane::kDefaultThreads;
+
+class DataPlane::Call {
+public:
+  // waits for the next call to the data plane.
+  explicit Call(DataPlane* plane)
+      : plane_(plane), stream_(&ctx_), state_(kWaiting), start_time_(0), opened_(false)
+      , version_(0), size_(0), start_(0), offset_(0), end_(0), err_(0) {
+    plane_->generic_.RequestCall(&ctx_, &stream_, plane_->cq_.get(), plane_->cq_.get(),
+      this);
+  }
+
+  // carries on once the call's last operation has completed. ok is false if
+  // it failed.
+  void Proceed(bool ok);
+private:
+  enum State { kWaiting, kReading, kWriting, kFinishing };
+
+  void Finish(const grpc::Status& status);
+
+  void Open();
+
+  void WriteChunk();
+
+  DataPlane* plane_;
+  grpc::GenericServerContext ctx_;
+  grpc::GenericServerAsyncReaderWriter stream_;
+  State state_;
+  long start_time_;
+  grpc::ByteBuffer message_;
+  AdmissionControl::Ticket ticket_;
+  bool opened_;
+  std::string path_;
+  std::string full_path_;
+  std::shared_ptr<FileHandle> handle_;
+  uint64_t version_;
+  off_t size_;
+  off_t start_;
+  off_t offset_;
+  off_t end_;
+  int err_;
+};
+
+void DataPlane::Call::Finish(const grpc::Status& status) {
+  if (opened_) {
+    // this thread may have served other calls since this one started.
+    EventLog::StartCall(start_time_);
+    Log()->DownloadRangeEvent(full_path_, path_, version_, start_, offset_ - start_, err_);
+  }
+  ticket_.Release();
+  handle_.reset();
+  state_ = kFinishing;
+  stream_.Finish(status, this);
+}
+
+// decodes the request, admits it and opens the file. the first chunk is
+// sent whether or not that worked.
+void DataPlane::Call::Open() {
+  std::vector<grpc::Slice> slices;
+  message_.Dump(&slices);
+  std::string request;
+  for (const grpc::Slice& slice : slices) {
+    request.append((const char*)slice.begin(), slice.size());
+  }
+  RequestHeader header;
+  if (!DecodeRequest(request, &header, &path_)) {
+    Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed read request"));
+    return;
+  }
+
+  FileService* service = plane_->service_;
+  full_path_ = service->PromoteToFullPath(path_);
+  long retry_ms = service->admission_.Admit(service->GetPeer(&ctx_), kChunkSize, false,
+    &ticket_);
+  if (retry_ms != 0) {
+    Finish(service->Refuse(&ctx_, "DataPlane", full_path_, path_, kChunkSize, retry_ms));
+    return;
+  }
+
+  opened_ = true;
+  version_ = header.version;
+  struct stat stat_buffer;
+  err_ = service->OpenRange(path_, full_path_, &version_, &handle_, &stat_buffer);
+  if (err_ == 0) {
+    size_ = stat_buffer.st_size;
+    start_ = std::min<uint64_t>(header.offset, size_);
+    // compared rather than added, since a length near 2^64 would wrap.
+    end_ = header.length == 0 || header.length >= (uint64_t)(size_ - start_) ? size_
+      : start_ + header.length;
+  }
+  offset_ = start_;
+  WriteChunk();
+}
+
+void DataPlane::Call::Proceed(bool ok) {
+  // once stopping, calls are dropped as their operations drain.
+  if (plane_->stopping_) {
+    delete this;
+    return;
+  }
+
+  switch (state_) {
+    case kWaiting: {
+      if (!ok) {
+        delete this;
+        return;
+      }
+      start_time_ = EventLog::GetTime();
+      new Call(plane_);
+      if (ctx_.method() != GetReadMethod()) {
+        Finish(grpc::Status(grpc::StatusCode::UNIMPLEMENTED,
+          "no data plane method " + ctx_.method()));
+        return;
+      }
+      state_ = kReading;
+      stream_.Read(&message_, this);
+    } break;
+    case kReading: {
+      if (!ok) {
+        Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "missing read request"));
+        return;
+      }
+      Open();
+    } break;
+    case kWriting: {
+      if (!ok) {
+        err_ = -ECONNABORTED;
+        Finish(grpc::Status::CANCELLED);
+      } else if (err_ != 0 || offset_ >= end_) {
+        Finish(grpc::Status::OK);
+      } else {
+        WriteChunk();
+      }
+    } break;
+    case kFinishing: {
+      delete this;
+    } break;
+  }
+}
+
+// sends a header and the next part of the range, or only a header after
+// an error. the body is read into a buffer that grpc frees once it has
+// been sent.
+void DataPlane::Call::WriteChunk() {
+  size_t want = err_ != 0 ? 0 : std::min<off_t>(kChunkSize, end_ - offset_);
+  char* body = nullptr;
+  ssize_t got = 0;
+  if (want != 0) {
+    body = (char*)malloc(want);
+    got = body == nullptr ? -ENOMEM
+      : plane_->service_->io_->Read(handle_->GetFd(), body, want, offset_);
+    if (got <= 0) {
+      free(body);
+      // a file that shrank since it was opened ends the range early.
+      if (got < 0) {
+        err_ = got;
+      } else {
+        end_ = offset_;
+      }
+      got = 0;
+    }
+  }
+
+  ChunkHeader header;
+  header.error_code = err_;
+  header.version = version_;
+  header.size = size_;
+  header.offset = offset_;
+  char head[kChunkHeaderSize];
+  EncodeChunk(header, head);
+  std::vector<grpc::Slice> slices;
+  slices.push_back(grpc::Slice(head, sizeof(head)));
+  if (got > 0) { slices.push_back(grpc::Slice(body, got, free)); }
+  message_ = grpc::ByteBuffer(slices.data(), slices.size());
+  offset_ += got;
+
+  state_ = kWriting;
+  stream_.Write(message_, this);
+}
+
+DataPlane::DataPlane(FileService* service) : service_(service), stopping_(false) { }
+
+DataPlane::~DataPlane() {
+  Stop();
+}
+
+void DataPlane::Serve() {
+  void* tag;
+  bool ok;
+  while (cq_->Next(&tag, &ok)) {
+    static_cast<Call*>(tag)->Proceed(ok);
+  }
+}
+
+void DataPlane::Start(std::unique_ptr<grpc::ServerCompletionQueue> cq, int threads) {
+  cq_ = std::move(cq);
+  // each thread's worth of waiting calls; every call that arrives posts
+  // another.
+  for (int i = 0; i < threads; ++i) {
+    new Call(this);
+  }
+  for (int i = 0; i < threads; ++i) {
+    threads_.push_back(std::thread(&DataPlane::Serve, this));
+  }
+}
+
+void DataPlane::Stop() {
+  if (cq_ == nullptr) { return; }
+  stopping_ = true;
+  cq_->Shutdown();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+  cq_.reset();
+}
@@ -0,0 +1,144 @@
+// data_plane.h : declares DataPlane, which serves file bodies through grpc's
+// generic api instead of protobuf messages.
+// by: allison morris
+
+#ifndef DATA_PLANE_H
+#define DATA_PLANE_H
+
+#include <atomic>
+#include <cstdint>
+#include <grpc++/generic/async_generic_service.h>
+#include <grpc++/grpc++.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace File {
+
+class FileService;
+
+// a raw read path beside BasicFileService, which keeps serving metadata. a
+// client calls GetReadMethod() with a single message, a request header followed
+// by the path, and gets back a stream of chunks, each a chunk header
+// followed by up to kChunkSize bytes of the file. the bytes are read
+// straight into a buffer that grpc sends and then frees, so a body is never
+// copied into a protobuf string, serialized, or copied again by the server.
+//
+// the first chunk is always sent, even for an empty range or an error, and
+// carries the file's size and version; after that the stream ends with the
+// last byte of the range. a nonzero error code in any chunk header is
+// -errno and ends the stream. a refused read fails with RESOURCE_EXHAUSTED
+// and a retry-after-ms trailer, like the rpcs.
+//
+// both headers are fixed size, with every field little-endian:
+//   request: magic u32, reserved u32, version u64, offset u64, length u64
+//   chunk:   magic u32, error code i32, version u64, size u64, offset u64
+// version and length of 0 mean the current file and the rest of it, as in
+// ReadRequest.
+class DataPlane {
+public:
+  static const uint32_t kMagic = 0x31504446;
+  static const size_t kRequestHeaderSize = 32;
+  static const size_t kChunkHeaderSize = 32;
+  static const size_t kChunkSize = 1 << 20;
+  static const int kDefaultThreads = 4;
+
+  struct RequestHeader {
+    uint64_t version;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  struct ChunkHeader {
+    int32_t error_code;
+    uint64_t version;
+    uint64_t size;
+    uint64_t offset;
+  };
+
+  explicit DataPlane(FileService* service);
+
+  ~DataPlane();
+
+  // the full name clients call. it is here rather than in data_plane.cc so
+  // that clients need not link the server.
+  static const char* GetReadMethod() { return "/File.DataPlane/Read"; }
+
+  // the generic service to register with the server builder.
+  grpc::AsyncGenericService* GetService() { return &generic_; }
+
+  // starts threads threads serving calls from cq, which must come from the
+  // same builder.
+  void Start(std::unique_ptr<grpc::ServerCompletionQueue> cq, int threads);
+
+  // stops serving. the server must have been shut down first.
+  void Stop();
+
+  // these build and take apart headers, for the server and its clients.
+  // the decoders return false if data is too short or is not a header.
+  static void EncodeChunk(const ChunkHeader& header, char* data) {
+    PutWord(kMagic, 4, data);
+    PutWord((uint32_t)header.error_code, 4, data + 4);
+    PutWord(header.version, 8, data + 8);
+    PutWord(header.size, 8, data + 16);
+    PutWord(header.offset, 8, data + 24);
+  }
+
+  static bool DecodeChunk(const char* data, size_t size, ChunkHeader* header) {
+    if (size < kChunkHeaderSize || GetWord(data, 4) != kMagic) { return false; }
+    header->error_code = (int32_t)GetWord(data + 4, 4);
+    header->version = GetWord(data + 8, 8);
+    header->size = GetWord(data + 16, 8);
+    header->offset = GetWord(data + 24, 8);
+    return true;
+  }
+
+  static std::string EncodeRequest(const RequestHeader& header, const std::string& path) {
+    std::string message(kRequestHeaderSize, '\0');
+    PutWord(kMagic, 4, &message[0]);
+    PutWord(header.version, 8, &message[8]);
+    PutWord(header.offset, 8, &message[16]);
+    PutWord(header.length, 8, &message[24]);
+    return message + path;
+  }
+
+  static bool DecodeRequest(const std::string& message, RequestHeader* header,
+      std::string* path) {
+    if (message.size() <= kRequestHeaderSize || GetWord(&message[0], 4) != kMagic) {
+      return false;
+    }
+    header->version = GetWord(&message[8], 8);
+    header->offset = GetWord(&message[16], 8);
+    header->length = GetWord(&message[24], 8);
+    path->assign(message, kRequestHeaderSize, std::string::npos);
+    return true;
+  }
+private:
+  class Call;
+
+  DataPlane(const DataPlane&);
+  DataPlane& operator=(const DataPlane&);
+
+  static uint64_t GetWord(const char* data, int bytes) {
+    uint64_t word = 0;
+    for (int i = bytes - 1; i >= 0; --i) { word = (word << 8) | (unsigned char)data[i]; }
+    return word;
+  }
+
+  static void PutWord(uint64_t word, int bytes, char* data) {
+    for (int i = 0; i < bytes; ++i, word >>= 8) { data[i] = (char)(word & 0xff); }
+  }
+
+  void Serve();
+
+  FileService* service_;
+  grpc::AsyncGenericService generic_;
+  std::unique_ptr<grpc::ServerCompletionQueue> cq_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> stopping_;
+};
+
+}
+
+#endif
@@ -1,18 +1,60 @@
 // event_log.cc
 // by: allison morris
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <ctime>
 #include <sys/stat.h>
 #include "event_log.h"
 
 using namespace File;
 
+const long EventLog::kTraceFlushMs;
 EventLog* EventLog::logger_;
 std::mutex EventLog::mutex_;
+thread_local long EventLog::call_start_;
+
+void EventLog::AdmissionRejectedEvent(const std::string& rpc, const std::string& full_path,
+    const std::string& path, long bytes, long retry_ms) {
+  Lock lock;
+  if (level_ >= kInfo) {
+    out_ << "BUSY " << rpc << " " << path << " " << bytes << " bytes, retry after "
+      << retry_ms << " ms";
+    if (level_ >= kDebug) { out_ << " (" << full_path << ")"; }
+    out_ << "\n";
+  }
+}
+
+void EventLog::BatchEvent(int ops, int failed) {
+  Lock lock;
+  if (level_ >= kInfo) {
+    out_ << "OK Batch " << ops << " ops, " << failed << " failed\n";
+  }
+}
+
+void EventLog::CopyEvent(const std::string& full_path, const std::string& path,
+    const std::string& to, long bytes, bool cloned, int err) {
+  Lock lock;
+  Trace("Copy", path, bytes, to);
+  if (level_ >= kInfo) {
+    if (err == 0) {
+      out_ << "OK Copy " << path << " -> " << to << " " << bytes << " bytes";
+      if (cloned) { out_ << " cloned"; }
+      if (level_ >= kDebug) { out_ << " (" << full_path << ")"; }
+      out_ << "\n";
+    } else {
+      HandleGoodErrors("Copy", full_path, path, err);
+    }
+  } else if (level_ >= kError && err != 0) {
+    HandleBadErrors("Copy", full_path, path, err);
+  }
+}
 
 void EventLog::CreateDirectoryEvent(const std::string& full_path, const std::string& path,
     int err) {
   Lock lock;
+  Trace("CreateDirectory", path, 0);
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK CreateDirectory " << path;
@@ -29,6 +71,7 @@ void EventLog::CreateDirectoryEvent(const std::string& full_path, const std::str
 void EventLog::CreateFileEvent(const std::string& full_path, const std::string& path,
     int err) {
   Lock lock;
+  Trace("CreateFile", path, 0);
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK CreateFile " << path;
@@ -45,6 +88,7 @@ void EventLog::CreateFileEvent(const std::string& full_path, const std::string&
 void EventLog::DownloadFileEvent(const std::string& full_path, const std::string& path,
     const std::string& contents, int err) {
   Lock lock;
+  Trace("DownloadFile", path, contents.size());
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK DownloadFile " << path << " " << contents.size() << " bytes";
@@ -59,6 +103,38 @@ void EventLog::DownloadFileEvent(const std::string& full_path, const std::string
   }
 }
 
+void EventLog::DownloadStreamEvent(const std::string& full_path, const std::string& path,
+    long bytes, int window, int err) {
+  Lock lock;
+  Trace("DownloadFileStream", path, bytes);
+  if (level_ >= kInfo) {
+    if (err == 0) {
+      out_ << "OK DownloadFileStream " << path << " " << bytes << " bytes";
+      if (level_ >= kDebug) {
+        out_ << " (" << full_path << ") readahead window: " << window;
+      }
+      out_ << "\n";
+    } else { HandleGoodErrors("DownloadFileStream", full_path, path, err); }
+  } else if (level_ >= kError && err != 0) {
+    HandleBadErrors("DownloadFileStream", full_path, path, err);
+  }
+}
+
+void EventLog::DownloadRangeEvent(const std::string& full_path, const std::string& path,
+    unsigned long version, long offset, long bytes, int err) {
+  Lock lock;
+  Trace("DownloadRange", path, bytes);
+  if (level_ >= kInfo) {
+    if (err == 0) {
+      out_ << "OK DownloadRange " << path << " " << bytes << " bytes at " << offset;
+      if (level_ >= kDebug) { out_ << " (" << full_path << ") version " << version; }
+      out_ << "\n";
+    } else { HandleGoodErrors("DownloadRange", full_path, path, err); }
+  } else if (level_ >= kError && err != 0) {
+    HandleBadErrors("DownloadRange", full_path, path, err);
+  }
+}
+
 void EventLog::DumpFile(const std::string& contents) {
   if (dump_files_) {
     out_ << "\n   data:";
@@ -95,8 +171,9 @@ void EventLog::DumpFile(const std::string& contents) {
 }
 
 void EventLog::FileInfoEvent(const std::string& full_path, const std::string& path, 
-    struct stat& info, int err, bool top_level) {
+    const struct stat& info, int err, bool top_level) {
   Lock lock;
+  if (top_level) { Trace("GetFileInfo", path, 0); }
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << (top_level ? "OK GetFileInfo " : "   info: ") << path;
@@ -116,8 +193,17 @@ void EventLog::FileInfoEvent(const std::string& full_path, const std::string& pa
   }
 }
 
+void EventLog::FlushTrace() {
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(kTraceFlushMs));
+    Lock lock;
+    trace_->flush();
+  }
+}
+
 void EventLog::GetDirectoryEvent(const std::string& full_path, const std::string& path, int err) { 
   Lock lock;
+  Trace("GetDirectoryContents", path, 0);
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK GetDirectoryContents " << path;
@@ -132,6 +218,12 @@ void EventLog::GetDirectoryEvent(const std::string& full_path, const std::string
   }
 }
 
+long EventLog::GetTime() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
 void EventLog::HandleBadErrors(const std::string& cmd, const std::string& full_path,
     const std::string& path, int err) {
   if (err != -ENOENT && err != -ENOTDIR) {
@@ -163,6 +255,36 @@ void EventLog::HandleGoodErrors(const std::string& cmd, const std::string& full_
       out_ << " (" << full_path << ")";
     }
     out_ << "\n";
+  } else if (err == -ESTALE) {
+    out_ << "USR " << cmd << " @estale " << path;
+    if (level_ >= kDebug) {
+      out_ << " (" << full_path << ")";
+    }
+    out_ << "\n";
+  }
+}
+
+void EventLog::HashIndexEvent(const std::string& implementation, bool good) {
+  Lock lock;
+  if (level_ >= kInfo) {
+    out_ << (good ? "OK HashIndex " : "ERR HashIndex not persisted ");
+    out_ << "sha-256 " << implementation << "\n";
+  }
+}
+
+void EventLog::IoBackendEvent(const std::string& name) {
+  Lock lock;
+  if (level_ >= kInfo) {
+    out_ << "OK IoBackend " << name << "\n";
+  }
+}
+
+void EventLog::MountPointEvent(const std::string& mount_point, int err) {
+  Lock lock;
+  if (level_ >= kError) {
+    out_ << "ERR MountPoint " << mount_point;
+    if (level_ >= kDebug) { out_ << " error code: " << err; }
+    out_ << "\n";
   }
 }
 
@@ -188,6 +310,7 @@ void EventLog::PersistentStartEvent(bool old_log, bool bad_entry, bool log_good)
 
 void EventLog::RemoveDirectoryEvent(const std::string& full_path, const std::string& path,int err) {
   Lock lock;
+  Trace("RemoveDirectory", path, 0);
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK RemoveDirectory " << path;
@@ -204,6 +327,7 @@ void EventLog::RemoveDirectoryEvent(const std::string& full_path, const std::str
 void EventLog::RemoveFileEvent(const std::string& full_path, const std::string& path,
     int err) {
   Lock lock;
+  Trace("RemoveFile", path, 0);
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK RemoveFile " << path;
@@ -217,6 +341,36 @@ void EventLog::RemoveFileEvent(const std::string& full_path, const std::string&
   }
 }
 
+void EventLog::RenameEvent(const std::string& full_path, const std::string& path,
+    const std::string& to, int err) {
+  Lock lock;
+  Trace("Rename", path, 0, to);
+  if (level_ >= kInfo) {
+    if (err == 0) {
+      out_ << "OK Rename " << path << " -> " << to;
+      if (level_ >= kDebug) { out_ << " (" << full_path << ")"; }
+      out_ << "\n";
+    } else {
+      HandleGoodErrors("Rename", full_path, path, err);
+    }
+  } else if (level_ >= kError && err != 0) {
+    HandleBadErrors("Rename", full_path, path, err);
+  }
+}
+
+void EventLog::StartCall(long time) {
+  call_start_ = time;
+}
+
+void EventLog::StartTrace(std::ostream* trace) {
+  Lock lock;
+  trace_start_ = GetTime();
+  trace_ = trace;
+  // filed is usually stopped by a signal, so the trace cannot wait for a
+  // shutdown to be flushed.
+  std::thread(&EventLog::FlushTrace, this).detach();
+}
+
 void EventLog::StartupEvent(const std::string& mount_point, const std::string& address) {
   if (level_ >= kInfo) {
     Lock lock;
@@ -224,9 +378,22 @@ void EventLog::StartupEvent(const std::string& mount_point, const std::string& a
   }
 }
 
+void EventLog::Trace(const char* rpc, const std::string& path, long bytes,
+    const std::string& to) {
+  if (trace_ == nullptr) { return; }
+  // a call that started before the trace is recorded at the trace's start.
+  // events outside of any marked call are recorded when they happen.
+  long start = call_start_ == 0 ? GetTime() : call_start_;
+  *trace_ << std::max(start - trace_start_, 0L) << " " << rpc << " " << bytes << " "
+    << path;
+  if (!to.empty()) { *trace_ << " /// " << to; }
+  *trace_ << "\n";
+}
+
 void EventLog::UploadFileEvent(const std::string& full_path, const std::string& path,
     const std::string& contents, int err) {
   Lock lock;
+  Trace("UploadFile", path, contents.size());
   if (level_ >= kInfo) {
     if (err == 0) {
       out_ << "OK UploadFile " << path << " " << contents.size() << " bytes";
@@ -240,3 +407,10 @@ void EventLog::UploadFileEvent(const std::string& full_path, const std::string&
     HandleBadErrors("UploadFile", full_path, path, err);
   }
 }
+
+void EventLog::UploadSupersededEvent(const std::string& full_path, const std::string& path) {
+  Lock lock;
+  if (level_ >= kDebug) {
+    out_ << "   superseded: " << path << " (" << full_path << ")\n";
+  }
+}
@@ -6,6 +6,7 @@
 
 #include <iostream>
 #include <mutex>
+#include <thread>
 
 struct stat;
 
@@ -16,30 +17,66 @@ enum LogLevel { kFatal, kError, kInfo, kDebug, kTrace };
 class EventLog {
 public:
   EventLog(std::ostream& out, LogLevel lvl, bool dump) : out_(out), level_(lvl),
-    dump_files_(dump) { }
+    dump_files_(dump), trace_(nullptr), trace_start_(0) { }
+
+  void AdmissionRejectedEvent(const std::string& rpc, const std::string& full_path,
+    const std::string& path, long bytes, long retry_ms);
+
+  void BatchEvent(int ops, int failed);
+
+  void CopyEvent(const std::string& full_path, const std::string& path,
+    const std::string& to, long bytes, bool cloned, int err);
 
   void CreateDirectoryEvent(const std::string& full_path, const std::string& path, int err);
   void CreateFileEvent(const std::string& full_path, const std::string& path, int err);
   // create file exists?
   void DownloadFileEvent(const std::string& full_path, const std::string& path,
     const std::string& contents, int err);
+  void DownloadRangeEvent(const std::string& full_path, const std::string& path,
+    unsigned long version, long offset, long bytes, int err);
+  void DownloadStreamEvent(const std::string& full_path, const std::string& path,
+    long bytes, int window, int err);
   // file exists?
   void FileInfoEvent(const std::string& full_path, const std::string& path,
-    struct stat& info, int err, bool top_level);
+    const struct stat& info, int err, bool top_level);
   void GetDirectoryEvent(const std::string& full_path, const std::string& path, int err);
+
+  void HashIndexEvent(const std::string& implementation, bool good);
   
   static EventLog* GetLog() { return logger_; }
 
+  // the monotonic clock in ns.
+  static long GetTime();
+
+  void IoBackendEvent(const std::string& name);
+
   static void Initialize(std::ostream& out, LogLevel lvl, bool dump) {
     logger_ = new EventLog(out, lvl, dump);
   }
 
+  void MountPointEvent(const std::string& mount_point, int err);
+
   void PersistentDirectoryEvent(const std::string& path, bool exists, int err);
    
   void PersistentStartEvent(bool old_log, bool bad_entry, bool log_good);
 
   void RemoveDirectoryEvent(const std::string& full_path, const std::string& path, int err);
   void RemoveFileEvent(const std::string& full_path, const std::string& path, int err);
+  void RenameEvent(const std::string& full_path, const std::string& path,
+    const std::string& to, int err);
+  // marks when the client call the calling thread is serving started, now
+  // by default. the trace records calls at that time, so that a replay
+  // issues them in the order clients did. a call served across threads,
+  // like the data plane's, marks its own start again before logging.
+  static void StartCall(long time = GetTime());
+
+  // from now on, also writes every client call to trace, one line of
+  // "<ns since start> <rpc> <bytes> <path>[ /// <to>]" each, which the
+  // tester's Replay mode can play back. lines are buffered and flushed
+  // every kTraceFlushMs, so a line is written within that long of its call
+  // finishing, in finishing order.
+  void StartTrace(std::ostream* trace);
+
   void StartupEvent(const std::string& mount_point, const std::string& address);
 
   static bool ToVerbosity(int v, LogLevel* lvl) {
@@ -55,6 +92,8 @@ public:
 
   void UploadFileEvent(const std::string& full_path, const std::string& path,
     const std::string& contents, int err);
+
+  void UploadSupersededEvent(const std::string& full_path, const std::string& path);
 private:
   class Lock : public std::lock_guard<std::mutex> {
   public:
@@ -69,11 +108,23 @@ private:
   void HandleGoodErrors(const std::string& cmd, const std::string& full_path,
     const std::string& path, int err);
 
+  // records a call in the trace, if one was started. mutex_ must be held.
+  void Trace(const char* rpc, const std::string& path, long bytes,
+    const std::string& to = std::string());
+
+  static const long kTraceFlushMs = 1000;
+
+  // flushes the trace every kTraceFlushMs, for as long as the server runs.
+  void FlushTrace();
+
   static EventLog* logger_;
   static std::mutex mutex_;
+  static thread_local long call_start_;
   std::ostream& out_;
   LogLevel level_;
   bool dump_files_;
+  std::ostream* trace_;
+  long trace_start_;
 };
 
 inline EventLog* Log() { return EventLog::GetLog(); }
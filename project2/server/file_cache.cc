@@ -0,0 +1,82 @@
+// file_cache.cc : implements FileCache.
+// by: allison morris
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "file_cache.h"
+
+using namespace File;
+
+FileHandle::~FileHandle() {
+  if (fd_ >= 0) { close(fd_); }
+}
+
+// returns the cached handle for path if it was opened on inode. a handle for
+// an older inode is dropped.
+std::shared_ptr<FileHandle> FileCache::Find(const std::string& path, ino_t inode) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(path);
+  if (iter == entries_.end()) { return std::shared_ptr<FileHandle>(); }
+  if (iter->second.file->GetInode() != inode) {
+    lru_.erase(iter->second.lru);
+    entries_.erase(iter);
+    return std::shared_ptr<FileHandle>();
+  }
+  lru_.splice(lru_.begin(), lru_, iter->second.lru);
+  return iter->second.file;
+}
+
+void FileCache::Invalidate(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto iter = entries_.begin(); iter != entries_.end();) {
+    const std::string& cached = iter->first;
+    if (cached == path || (cached.size() > path.size() &&
+        cached.compare(0, path.size(), path) == 0 && cached[path.size()] == '/')) {
+      lru_.erase(iter->second.lru);
+      iter = entries_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+int FileCache::Open(const PathResolver::Location& location, const std::string& path,
+    std::shared_ptr<FileHandle>* handle, struct stat* st) {
+  int err = io_->Stat(location.GetDirFd(), location.name, st);
+  if (err != 0) { return err; }
+  *handle = Find(path, st->st_ino);
+  if (*handle) { return 0; }
+
+  int fd = io_->Open(location.GetDirFd(), location.name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) { return fd; }
+  // the path may have been replaced since the stat above, so key the handle
+  // by what was actually opened.
+  if (fstat(fd, st) != 0) {
+    err = -errno;
+    io_->Close(fd);
+    return err;
+  }
+  *handle = std::make_shared<FileHandle>(fd, st->st_ino);
+  if (S_ISREG(st->st_mode)) { Store(path, *handle); }
+  return 0;
+}
+
+void FileCache::Store(const std::string& path, const std::shared_ptr<FileHandle>& file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(path);
+  if (iter != entries_.end()) {
+    iter->second.file = file;
+    lru_.splice(lru_.begin(), lru_, iter->second.lru);
+    return;
+  }
+
+  lru_.push_front(path);
+  Entry& entry = entries_[path];
+  entry.file = file;
+  entry.lru = lru_.begin();
+  while (entries_.size() > kCapacity) {
+    entries_.erase(lru_.back());
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,79 @@
+// file_cache.h : declares FileCache, which keeps recently read files open.
+// by: allison morris
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include "io_backend.h"
+#include "path_resolver.h"
+
+namespace File {
+
+// a file opened read-only. one handle is shared by every request reading the
+// file, so reads must give their own offset (IoBackend::Read) and never move
+// the descriptor's file offset. the descriptor is closed when the last user
+// lets go.
+class FileHandle {
+public:
+  FileHandle(int fd, ino_t inode) : fd_(fd), inode_(inode) { }
+
+  ~FileHandle();
+
+  int GetFd() const { return fd_; }
+
+  ino_t GetInode() const { return inode_; }
+private:
+  FileHandle(const FileHandle&);
+  FileHandle& operator=(const FileHandle&);
+
+  int fd_;
+  ino_t inode_;
+};
+
+// a bounded lru of read descriptors keyed by (path, inode). a lookup stats
+// the path and reuses the cached descriptor only if the path still names the
+// inode that was opened, so a file replaced behind the server's back is
+// never served stale. the server invalidates a path itself whenever it
+// uploads, renames or removes it, which closes the old descriptor promptly.
+class FileCache {
+public:
+  static const size_t kCapacity = 128;
+
+  explicit FileCache(IoBackend* io) : io_(io) { }
+
+  // forgets path and every cached file below it.
+  void Invalidate(const std::string& path);
+
+  // opens the file at location for reading, or reuses a cached descriptor.
+  // path is the key, normally the full path. st receives the attributes of
+  // the file behind handle. returns 0 or -errno.
+  int Open(const PathResolver::Location& location, const std::string& path,
+    std::shared_ptr<FileHandle>* handle, struct stat* st);
+private:
+  typedef std::list<std::string> LruList;
+
+  struct Entry {
+    std::shared_ptr<FileHandle> file;
+    LruList::iterator lru;
+  };
+
+  std::shared_ptr<FileHandle> Find(const std::string& path, ino_t inode);
+
+  void Store(const std::string& path, const std::shared_ptr<FileHandle>& file);
+
+  IoBackend* io_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  LruList lru_;
+};
+
+}
+
+#endif
@@ -1,104 +1,406 @@
 // file_service.cc
 // by: allison morris
 
-// this file implements the server-side of the rpc calls. these functions
-// prioritize using standard c++ streams for simplicity and portability at
-// the expense of performance. however, performance is appropriate for our
-// needs. 
+// this file implements the server-side of the rpc calls. file i/o goes
+// through an IoBackend, which is either plain blocking posix calls or
+// io_uring, chosen at startup.
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 #include "file_service.h"
 #include "event_log.h"
+#include "readahead.h"
+#include "sha256.h"
 
 using namespace File;
 using grpc::ServerContext;
 using grpc::Status;
 
+const size_t FileService::kStreamChunkSize;
+
+// runs the operations of a batch in order on behalf of one client. the
+// batch is scheduled and admitted as a single request, so a thousand small
+// files cost one round trip and one trip through the queues.
+Status FileService::Batch(ServerContext* ctx, const BatchRequest* request,
+    BatchReply* reply) {
+  assert(request != nullptr && reply != nullptr);
+  EventLog::StartCall();
+  std::string peer = GetPeer(ctx);
+  long bytes = 0;
+  bool uploads = false;
+  for (const BatchOp& op : request->ops()) {
+    bytes += op.contents().size();
+    uploads = uploads || op.type() == BatchOp::UPLOAD;
+  }
+
+  AdmissionControl::Ticket ticket;
+  long retry_ms = admission_.Admit(peer, bytes, uploads, &ticket);
+  if (retry_ms != 0) {
+    return Refuse(ctx, "Batch", GetMountPoint(), std::string(), bytes, retry_ms);
+  }
+
+  // a batch is charged like the requests it stands for.
+  RequestScheduler::Slot slot(&scheduler_, peer,
+    uploads ? RequestScheduler::kBulk : RequestScheduler::kMetadata, request->ops_size());
+  slot.Charge(bytes);
+  if (request->atomic()) { return RunAtomicBatch(*request, reply); }
+
+  int failed = 0;
+  for (const BatchOp& op : request->ops()) {
+    int err = 0;
+    const std::string& path = op.path();
+    if (path.empty()) {
+      err = -EINVAL;
+    } else if (op.type() == BatchOp::MKDIR) {
+      err = CreateDirectory(path);
+    } else if (op.type() == BatchOp::CREATE) {
+      err = CreateFile(path);
+    } else if (op.type() == BatchOp::UPLOAD) {
+      FileInfo info;
+      err = UploadFile(path, op.contents(), &info);
+    } else if (op.type() == BatchOp::REMOVE) {
+      err = RemoveFile(path);
+    } else if (op.type() == BatchOp::RMDIR) {
+      err = RemoveDirectory(path);
+    } else {
+      err = -EINVAL;
+    }
+    reply->add_results()->set_error_code(err);
+    if (err != 0) { ++failed; }
+  }
+  Log()->BatchEvent(request->ops_size(), failed);
+  return Status::OK;
+}
+
+// runs a batch as one PersistentState group, so that it commits as a whole
+// or, if any operation cannot be staged, not at all. a committed operation
+// can still fail when applied without undoing the others, which the
+// per-operation results report. only operations the journal can replay are
+// allowed: uploads, creates (as empty uploads to a path that must not exist
+// yet) and file removes.
+Status FileService::RunAtomicBatch(const BatchRequest& request, BatchReply* reply) {
+  PersistentState::UpdateGroup group;
+  std::vector<PathResolver::Location> locations(request.ops_size());
+  int err = persistence_.BeginGroup(&group);
+  int failed_op = err == 0 ? -1 : 0;
+  for (int i = 0; i < request.ops_size() && err == 0; ++i) {
+    const BatchOp& op = request.ops(i);
+    const std::string& path = op.path();
+    err = path.empty() ? -EINVAL : resolver_.Resolve(path, &locations[i]);
+    if (err == 0) { err = StageBatchOp(op, locations[i], &group); }
+    if (err != 0) { failed_op = i; }
+  }
+  if (err == 0) { err = persistence_.CommitGroup(&group); }
+
+  int failed = 0;
+  for (int i = 0; i < request.ops_size(); ++i) {
+    int result = err == 0 ? group.GetResult(i) : (i == failed_op ? err : -ECANCELED);
+    reply->add_results()->set_error_code(result);
+    if (result != 0) { ++failed; }
+    if (err == 0) { files_.Invalidate(PromoteToFullPath(request.ops(i).path())); }
+  }
+  Log()->BatchEvent(request.ops_size(), failed);
+  return Status::OK;
+}
+
+// stages a copy of from and renames it over to, like an upload whose data
+// never leaves the server. info receives the new file's attributes.
+Status FileService::Copy(ServerContext* ctx, const CopyRequest* request,
+    FileInfo* info) {
+  assert(request != nullptr && info != nullptr);
+  EventLog::StartCall();
+  std::string peer = GetPeer(ctx);
+  const std::string& from = request->from();
+  const std::string& to = request->to();
+  if (from.empty() || to.empty()) {
+    info->set_error_code(-EINVAL);
+    Log()->CopyEvent(GetMountPoint(), from, to, 0, false, -EINVAL);
+    return Status::OK;
+  }
+  std::string from_full_path = PromoteToFullPath(from);
+  std::string to_full_path = PromoteToFullPath(to);
+
+  // the data goes from file to file inside the kernel, so only the staging
+  // slot is reserved.
+  AdmissionControl::Ticket ticket;
+  long retry_ms = admission_.Admit(peer, 0, true, &ticket);
+  if (retry_ms != 0) { return Refuse(ctx, "Copy", from_full_path, from, 0, retry_ms); }
+
+  RequestScheduler::Slot slot(&scheduler_, peer, RequestScheduler::kBulk);
+  PathResolver::Location from_location;
+  PathResolver::Location to_location;
+  std::shared_ptr<FileHandle> handle;
+  struct stat stat_buffer;
+  int err = resolver_.Resolve(from, &from_location);
+  if (err == 0) { err = resolver_.Resolve(to, &to_location); }
+  if (err == 0) { err = files_.Open(from_location, from_full_path, &handle, &stat_buffer); }
+  if (err == 0 && S_ISDIR(stat_buffer.st_mode)) { err = -EISDIR; }
+  if (err == 0 && !S_ISREG(stat_buffer.st_mode)) { err = -EINVAL; }
+  if (err != 0) {
+    Log()->CopyEvent(from_full_path, from, to, 0, false, err);
+    info->set_error_code(err);
+    return Status::OK;
+  }
+
+  PersistentState::UpdateToken token(to_full_path);
+  token.SetTargetLocation(to_location.GetDirFd(), to_location.name);
+  if (!persistence_.CreateUpdateFile(to_full_path, &token)) {
+    err = -errno;
+    Log()->CopyEvent(from_full_path, from, to, 0, false, err);
+    info->set_error_code(err);
+    return Status::OK;
+  }
+
+  bool cloned = false;
+  struct stat staged;
+  bool indexed = false;
+  err = persistence_.CopyUpdate(&token, handle->GetFd(), stat_buffer.st_size, &cloned);
+  if (err != 0) {
+    persistence_.AbortUpdate(&token);
+  } else {
+    indexed = fstat(token.GetFd(), &staged) == 0;
+    err = persistence_.FinalizeUpdate(&token);
+  }
+  slot.Charge(cloned ? 0 : stat_buffer.st_size);
+  if (err == 0 && !token.IsSuperseded()) {
+    files_.Invalidate(to_full_path);
+    // the copy has the source's contents, and so its hash.
+    std::string digest;
+    if (indexed && hashes_.Find(stat_buffer, &digest)) {
+      hashes_.Store(to_full_path, staged, digest);
+    }
+  }
+
+  if (token.IsSuperseded()) { Log()->UploadSupersededEvent(to_full_path, to); }
+  Log()->CopyEvent(from_full_path, from, to, stat_buffer.st_size, cloned, err);
+  if (err != 0) {
+    info->set_error_code(err);
+    return Status::OK;
+  }
+  GetFileInfo(to_location, to_full_path, to, false, info);
+  return Status::OK;
+}
+
 Status FileService::CreateDirectory(ServerContext* ctx, const Path* path,
     Result* result) {
   assert(path != nullptr && result != nullptr);
-  std::string full_path = PromoteToFullPath(path->data());
-  int ret = mkdir(full_path.c_str(), 0755);
-  int err = GetError(ret);
-  Log()->CreateDirectoryEvent(full_path, path->data(), err);
-  result->set_error_code(err);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
+  result->set_error_code(CreateDirectory(path->data()));
   return Status::OK;
 }
 
+int FileService::CreateDirectory(const std::string& path) {
+  std::string full_path = PromoteToFullPath(path);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
+  if (err == 0) { err = io_->MakeDirectory(location.GetDirFd(), location.name, 0755); }
+  Log()->CreateDirectoryEvent(full_path, path, err);
+  return err;
+}
+
 Status FileService::CreateFile(ServerContext* ctx, const Path* path,
     Result* result) {
   assert(path != nullptr);
+  EventLog::StartCall();
   assert(result != nullptr);
-  std::string full_path = PromoteToFullPath(path->data());
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
+  result->set_error_code(CreateFile(path->data()));
+  return Status::OK;
+}
+
+int FileService::CreateFile(const std::string& path) {
+  std::string full_path = PromoteToFullPath(path);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
 
   // cannot create if file already exists.
-  if (FileExists(full_path)) {
-    Log()->CreateFileEvent(full_path, path->data(), -EEXIST);
-    result->set_error_code(-EEXIST);
-    return Status::OK;
+  if (err == 0) {
+    int fd = io_->Open(location.GetDirFd(), location.name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    err = fd < 0 ? fd : io_->Close(fd);
   }
-
-  std::ofstream new_file(full_path, std::ios::out | std::ios::trunc);
-  int ret = new_file.good() ? 0 : -1;
-  int err = GetError(ret);
-  result->set_error_code(err);
-  Log()->CreateFileEvent(full_path, path->data(), err);
-  return Status::OK;
+  Log()->CreateFileEvent(full_path, path, err);
+  return err;
 }
 
 // returns the file located by path to the client.
 Status FileService::DownloadFile(ServerContext* ctx, const Path* path,
     File* file) {
   assert(path != nullptr && file != nullptr);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kBulk);
   std::string full_path = PromoteToFullPath(path->data());
-  std::ifstream stream;
+  PathResolver::Location location;
+  std::shared_ptr<FileHandle> handle;
+  struct stat stat_buffer;
+  int err = resolver_.Resolve(path->data(), &location);
 
   // return invalid if file could not be opened.
-  if (!GetIfstream(full_path, &stream)) {
-    file->mutable_info()->set_error_code(-errno);
-    Log()->DownloadFileEvent(full_path, path->data(), std::string(), -errno);
+  if (err == 0) { err = files_.Open(location, full_path, &handle, &stat_buffer); }
+  if (err != 0) {
+    file->mutable_info()->set_error_code(err);
+    Log()->DownloadFileEvent(full_path, path->data(), std::string(), err);
     return Status::OK;
   }
 
-  // read file in chunks of up to 1024 bytes.
-  static const int kMaxSize = 1024;
-  bool stop = false;
-  do {
-    char buffer[kMaxSize];
-    stream.read(buffer, kMaxSize);
-    int read_size = stream.gcount();
-    if (read_size > 0) {
-      file->mutable_contents()->append(buffer, read_size);
-    } else {
-      stop = true;
-    }
-  } while (!stop);
+  // the whole file is held in memory until it is sent.
+  AdmissionControl::Ticket ticket;
+  long retry_ms = admission_.Admit(GetPeer(ctx), stat_buffer.st_size, false, &ticket);
+  if (retry_ms != 0) {
+    return Refuse(ctx, "DownloadFile", full_path, path->data(), stat_buffer.st_size, retry_ms);
+  }
+
+  err = io_->ReadAll(handle->GetFd(), file->mutable_contents());
+  slot.Charge(file->contents().size());
+  if (err != 0) {
+    file->clear_contents();
+    file->mutable_info()->set_error_code(err);
+    Log()->DownloadFileEvent(full_path, path->data(), std::string(), err);
+    return Status::OK;
+  }
+
+  // the whole file passed through memory, so index its hash if it is new.
+  std::string digest;
+  if (S_ISREG(stat_buffer.st_mode) && !hashes_.Find(stat_buffer, &digest)) {
+    Sha256 hash;
+    hash.Update(file->contents().data(), file->contents().size());
+    hashes_.Store(full_path, stat_buffer, hash.Final());
+  }
 
   // FIXME should check that data was written.
   Log()->DownloadFileEvent(full_path, path->data(), file->contents(), 0);
-  GetFileInfo(full_path, path->data(), false, file->mutable_info());
+  // the file arrived whole, so there is nothing to resume and no version
+  // is pinned.
+  SetFileInfo(stat_buffer, full_path, path->data(), false, file->mutable_info());
   return Status::OK;
 }
 
-// returns true if the file exists.
-bool FileService::FileExists(const std::string& full_path) const {
-  std::ifstream stream;
-  return GetIfstream(full_path, &stream);
+// streams the file located by path to the client in chunks. the kernel is
+// told to read ahead of the chunk being sent, so that disk reads overlap
+// with the client draining the stream.
+Status FileService::DownloadFileStream(ServerContext* ctx, const Path* path,
+    grpc::ServerWriter<FileChunk>* writer) {
+  assert(path != nullptr && writer != nullptr);
+  EventLog::StartCall();
+  std::string full_path = PromoteToFullPath(path->data());
+  std::string peer = GetPeer(ctx);
+
+  // only one chunk is held in memory at a time.
+  AdmissionControl::Ticket ticket;
+  long retry_ms = admission_.Admit(peer, kStreamChunkSize, false, &ticket);
+  if (retry_ms != 0) {
+    return Refuse(ctx, "DownloadFileStream", full_path, path->data(), kStreamChunkSize,
+      retry_ms);
+  }
+
+  RequestScheduler::Slot slot(&scheduler_, peer, RequestScheduler::kBulk);
+  // with arenas on, the chunk and its info live on the call's arena and its
+  // body is a pooled buffer, which is declared after the arena so that it
+  // is taken back before the arena goes.
+  CallArena arena(arenas_);
+  FileChunk* chunk = arena.Create<FileChunk>();
+  BufferPool::Buffer body(arenas_ ? kStreamChunkSize : 0);
+  body.Lend(chunk->mutable_contents());
+
+  PathResolver::Location location;
+  std::shared_ptr<FileHandle> handle;
+  struct stat stat_buffer;
+  int err = resolver_.Resolve(path->data(), &location);
+  if (err == 0) { err = files_.Open(location, full_path, &handle, &stat_buffer); }
+  if (err != 0) {
+    chunk->mutable_info()->set_error_code(err);
+    Log()->DownloadStreamEvent(full_path, path->data(), 0, 0, err);
+    writer->Write(*chunk);
+    return Status::OK;
+  }
+  SetFileInfo(stat_buffer, full_path, path->data(), false, chunk->mutable_info());
+  chunk->mutable_info()->set_version(versions_.Pin(full_path, handle, stat_buffer));
+
+  off_t sent = 0;
+  int window = 0;
+  err = SendChunks(ctx, handle->GetFd(), 0, chunk->info().size(), chunk, writer, &slot,
+    &sent, &window);
+  Log()->DownloadStreamEvent(full_path, path->data(), sent, window, err);
+  return Status::OK;
+}
+
+// streams part of a file like DownloadFileStream. naming a version reads
+// the file a download was served from, whatever has happened to path since.
+Status FileService::DownloadRange(ServerContext* ctx, const ReadRequest* request,
+    grpc::ServerWriter<FileChunk>* writer) {
+  assert(request != nullptr && writer != nullptr);
+  EventLog::StartCall();
+  const std::string& path = request->path();
+  if (path.empty()) {
+    FileChunk chunk;
+    chunk.mutable_info()->set_error_code(-EINVAL);
+    Log()->DownloadRangeEvent(GetMountPoint(), path, request->version(), request->offset(),
+      0, -EINVAL);
+    writer->Write(chunk);
+    return Status::OK;
+  }
+  std::string full_path = PromoteToFullPath(path);
+  std::string peer = GetPeer(ctx);
+
+  AdmissionControl::Ticket ticket;
+  long retry_ms = admission_.Admit(peer, kStreamChunkSize, false, &ticket);
+  if (retry_ms != 0) {
+    return Refuse(ctx, "DownloadRange", full_path, path, kStreamChunkSize, retry_ms);
+  }
+
+  RequestScheduler::Slot slot(&scheduler_, peer, RequestScheduler::kBulk);
+  CallArena arena(arenas_);
+  FileChunk* chunk = arena.Create<FileChunk>();
+  BufferPool::Buffer body(arenas_ ? kStreamChunkSize : 0);
+  body.Lend(chunk->mutable_contents());
+
+  std::shared_ptr<FileHandle> handle;
+  struct stat stat_buffer;
+  uint64_t version = request->version();
+  int err = OpenRange(path, full_path, &version, &handle, &stat_buffer);
+  if (err != 0) {
+    chunk->mutable_info()->set_error_code(err);
+    Log()->DownloadRangeEvent(full_path, path, version, request->offset(), 0, err);
+    writer->Write(*chunk);
+    return Status::OK;
+  }
+  SetFileInfo(stat_buffer, full_path, path, false, chunk->mutable_info());
+  chunk->mutable_info()->set_version(version);
+
+  off_t size = stat_buffer.st_size;
+  off_t offset = std::min<uint64_t>(request->offset(), size);
+  // compared rather than added, since a length near 2^64 would wrap.
+  uint64_t length = request->length();
+  off_t end = length == 0 || length >= (uint64_t)(size - offset) ? size : offset + length;
+  off_t sent = 0;
+  int window = 0;
+  err = SendChunks(ctx, handle->GetFd(), offset, end, chunk, writer, &slot, &sent, &window);
+  Log()->DownloadRangeEvent(full_path, path, version, offset, sent, err);
+  return Status::OK;
 }
 
 Status FileService::GetDirectoryContents(ServerContext* ctx, const Path* path,
     DirInfo* info) {
   assert(path != nullptr && info != nullptr);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
   std::string full_path = PromoteToFullPath(path->data());
-  DIR* dir;
-  dir = opendir(full_path.c_str());
+  PathResolver::Location location;
+  int fd = resolver_.Resolve(path->data(), &location);
+  if (fd == 0) {
+    fd = io_->Open(location.GetDirFd(), location.name, O_RDONLY | O_DIRECTORY, 0);
+  }
+  DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
   if (dir == nullptr) {
-    int err = -errno;
+    int err = fd < 0 ? fd : -errno;
+    if (fd >= 0) { io_->Close(fd); }
     Log()->GetDirectoryEvent(full_path, path->data(), err);
     info->set_error_code(err);
     return Status::OK;
@@ -128,22 +430,77 @@ inline int FileService::GetError(int ret) const {
   return -errno;
 }
 
-// fills info with the access, creation, and modification times of full_path.
-// returns true on success. this does not send a message!
-bool FileService::GetFileInfo(const std::string& full_path, const std::string& path, 
-    bool top_level, FileInfo* info) const {
+// fills info with the access, creation, and modification times of the file
+// at location. returns true on success. this does not send a message!
+bool FileService::GetFileInfo(const PathResolver::Location& location,
+    const std::string& full_path, const std::string& path, bool top_level,
+    FileInfo* info) const {
   assert(info != nullptr);
   struct stat stat_buffer;
-  int stat_result = stat(full_path.c_str(), &stat_buffer);
+  int err = io_->Stat(location.GetDirFd(), location.name, &stat_buffer);
   
   // return that path is invalid if file cannot be stat'd.
-  if (stat_result == -1) {
-    info->set_error_code(-errno);
-    Log()->FileInfoEvent(full_path, path, stat_buffer, -errno, top_level);
+  if (err != 0) {
+    info->set_error_code(err);
+    Log()->FileInfoEvent(full_path, path, stat_buffer, err, top_level);
     return false;
   }
 
   // otherwise, return the access, mod, and creation times.
+  SetFileInfo(stat_buffer, full_path, path, top_level, info);
+  return true;
+}
+
+int FileService::SendChunks(ServerContext* ctx, int fd, off_t offset, off_t end,
+    FileChunk* chunk, grpc::ServerWriter<FileChunk>* writer, RequestScheduler::Slot* slot,
+    off_t* sent, int* window) {
+  ReadaheadWindow readahead(fd, end, kStreamChunkSize);
+  off_t start_offset = offset;
+  int err = 0;
+  do {
+    readahead.Advance(offset);
+    size_t want = std::min<off_t>(kStreamChunkSize, end - offset);
+    chunk->mutable_contents()->resize(want);
+    long start = ReadaheadWindow::GetTime();
+    ssize_t got = want == 0 ? 0 : io_->Read(fd, &(*chunk->mutable_contents())[0], want, offset);
+    readahead.RecordRead(ReadaheadWindow::GetTime() - start);
+    if (got < 0) {
+      err = got;
+      break;
+    }
+    chunk->mutable_contents()->resize(got);
+    chunk->set_offset(offset);
+    offset += got;
+    slot->Charge(got);
+
+    // the slot covers the read only; a slow client draining the stream
+    // must not keep other requests off the disk.
+    bool written;
+    {
+      RequestScheduler::Slot::Pause pause(slot);
+      start = ReadaheadWindow::GetTime();
+      written = writer->Write(*chunk);
+      readahead.RecordSend(ReadaheadWindow::GetTime() - start);
+    }
+    if (!written) {
+      err = -ECONNABORTED;
+      break;
+    }
+
+    // only the first chunk carries the info.
+    chunk->clear_info();
+    if (got == 0) { break; }
+  } while (offset < end && !ctx->IsCancelled());
+
+  *sent = offset - start_offset;
+  *window = readahead.GetWindow();
+  return err;
+}
+
+// fills info from stat_buffer, which the caller already has.
+void FileService::SetFileInfo(const struct stat& stat_buffer,
+    const std::string& full_path, const std::string& path, bool top_level,
+    FileInfo* info) const {
   Log()->FileInfoEvent(full_path, path, stat_buffer, 0, top_level);
   info->set_error_code(0);
   info->set_mode(stat_buffer.st_mode);
@@ -152,26 +509,29 @@ bool FileService::GetFileInfo(const std::string& full_path, const std::string& p
   info->set_modification_time(stat_buffer.st_mtime);
   info->set_size(stat_buffer.st_size);
   info->set_inode(stat_buffer.st_ino);
-  return true;
+  std::string digest;
+  if (S_ISREG(stat_buffer.st_mode) && hashes_.Find(stat_buffer, &digest)) {
+    info->set_sha256(digest);
+  }
 }
 
 // returns the time info of the file pointed to by path.
 Status FileService::GetFileInfo(ServerContext* ctx, const Path* path,
     FileInfo* info) {
   assert(path != nullptr && info != nullptr);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
   std::string full_path = PromoteToFullPath(path->data());
-  GetFileInfo(full_path, path->data(), true, info);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path->data(), &location);
+  if (err != 0) {
+    info->set_error_code(err);
+    return Status::OK;
+  }
+  GetFileInfo(location, full_path, path->data(), true, info);
   return Status::OK;
 }
 
-// opens the ifstream pointed to by stream to full_path and returns
-// stream->good().
-bool FileService::GetIfstream(const std::string& full_path, std::ifstream* stream) const {
-  assert(stream != nullptr);
-  stream->open(full_path, std::ios::in);
-  return stream->good();
-}
-
 // opens the ofstream pointed to by stream to full_path and returns
 // stream->good().
 bool FileService::GetOfstream(const std::string& full_path, std::ofstream* stream) const {
@@ -180,76 +540,274 @@ bool FileService::GetOfstream(const std::string& full_path, std::ofstream* strea
   return stream->good();
 }
 
+// returns the client's address, which names its queue in the scheduler.
+std::string FileService::GetPeer(ServerContext* ctx) const {
+  return ctx == nullptr ? std::string() : ctx->peer();
+}
+
+// reports how much of the admission limits is in use.
+Status FileService::GetServerStats(ServerContext* ctx, const StatsRequest* request,
+    ServerStats* stats) {
+  assert(stats != nullptr);
+  AdmissionControl::Usage usage = admission_.GetUsage();
+  stats->set_in_flight_bytes(usage.bytes);
+  stats->set_in_flight_byte_limit(usage.byte_limit);
+  stats->set_client_byte_limit(usage.client_byte_limit);
+  stats->set_staged_uploads(usage.uploads);
+  stats->set_staged_upload_limit(usage.upload_limit);
+  stats->set_client_upload_limit(usage.client_upload_limit);
+  stats->set_active_clients(usage.clients);
+  stats->set_rejected_requests(usage.rejected);
+  return Status::OK;
+}
+
 // initializes the service. particularly, ensures persistent state is up.
 bool FileService::Initialize() {
-  return persistence_.StartAndRecoverState();
+  Log()->IoBackendEvent(io_->GetName());
+  if (!resolver_.Initialize()) {
+    Log()->MountPointEvent(GetMountPoint(), -errno);
+    return false;
+  }
+  if (!persistence_.StartAndRecoverState()) { return false; }
+  persistence_.RemoveStaleLinks(GetMountPoint());
+  // without the index hashes are only kept until restart.
+  Log()->HashIndexEvent(Sha256::GetImplementation(), hashes_.Load());
+  return true;
 }
 
-// combines suffix with the mount point to obtain the full path.
+int FileService::OpenRange(const std::string& path, const std::string& full_path,
+    uint64_t* version, std::shared_ptr<FileHandle>* handle, struct stat* stat_buffer) {
+  if (*version != 0) { return versions_.Find(full_path, *version, handle, stat_buffer); }
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
+  if (err == 0) { err = files_.Open(location, full_path, handle, stat_buffer); }
+  if (err == 0 && S_ISDIR(stat_buffer->st_mode)) { err = -EISDIR; }
+  if (err == 0) { *version = versions_.Pin(full_path, *handle, *stat_buffer); }
+  return err;
+}
+
+// combines suffix with the mount point to obtain the full path. this is
+// only used for logging and to key per-path state, like the order of
+// uploads; file operations go through resolver_. suffix is normalized, so
+// that every spelling of a path keys the same state.
 std::string FileService::PromoteToFullPath(const std::string& suffix) const {
   static const char kSeparator = '/';
-  if (suffix.front() == kSeparator) {
-    return GetMountPoint() + suffix;
-  } else {
-    return GetMountPoint() + kSeparator + suffix;
+  return GetMountPoint() + kSeparator + PathResolver::Normalize(suffix);
+}
+
+// turns a request away because a limit on in-flight requests was hit. the
+// client is told when to try again in the retry-after-ms trailer.
+Status FileService::Refuse(ServerContext* ctx, const std::string& rpc,
+    const std::string& full_path, const std::string& path, long bytes, long retry_ms) {
+  Log()->AdmissionRejectedEvent(rpc, full_path, path, bytes, retry_ms);
+  if (ctx != nullptr) {
+    ctx->AddTrailingMetadata("retry-after-ms", std::to_string(retry_ms));
   }
+  return Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+    "server busy, retry after " + std::to_string(retry_ms) + " ms");
 }
 
 Status FileService::RemoveDirectory(ServerContext* ctx, const Path* path, 
     Result* result) {
   assert(path != nullptr && result != nullptr);
-  std::string full_path = PromoteToFullPath(path->data());
-  int ret = rmdir(full_path.c_str());
-  int err = GetError(ret);
-  Log()->RemoveDirectoryEvent(full_path, path->data(), err);
-  result->set_error_code(err);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
+  result->set_error_code(RemoveDirectory(path->data()));
   return Status::OK;
 }
 
+int FileService::RemoveDirectory(const std::string& path) {
+  std::string full_path = PromoteToFullPath(path);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
+  if (err == 0) { err = io_->Unlink(location.GetDirFd(), location.name, AT_REMOVEDIR); }
+  if (err == 0) { resolver_.Invalidate(path); }
+  Log()->RemoveDirectoryEvent(full_path, path, err);
+  return err;
+}
+
 Status FileService::RemoveFile(ServerContext* ctx, const Path* path, 
     Result* result) {
   assert(path != nullptr && result != nullptr);
-  std::string full_path = PromoteToFullPath(path->data());
-  int ret = std::remove(full_path.c_str());
-  int err = GetError(ret);
-  Log()->RemoveFileEvent(full_path, path->data(), err);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
+  result->set_error_code(RemoveFile(path->data()));
+  return Status::OK;
+}
+
+int FileService::RemoveFile(const std::string& path) {
+  std::string full_path = PromoteToFullPath(path);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
+  if (err == 0) { err = io_->Unlink(location.GetDirFd(), location.name, 0); }
+  if (err == 0) { files_.Invalidate(full_path); }
+  Log()->RemoveFileEvent(full_path, path, err);
+  return err;
+}
+
+// renames a file or directory with renameat2. the rename is journaled as a
+// one-operation group, which is ordered against uploads of either path and
+// syncs both parent directories, so it is durable once this returns.
+Status FileService::Rename(ServerContext* ctx, const RenameRequest* request,
+    Result* result) {
+  assert(request != nullptr && result != nullptr);
+  EventLog::StartCall();
+  RequestScheduler::Slot slot(&scheduler_, GetPeer(ctx), RequestScheduler::kMetadata);
+  const std::string& from = request->from();
+  const std::string& to = request->to();
+  if (from.empty() || to.empty() || (request->no_replace() && request->exchange())) {
+    result->set_error_code(-EINVAL);
+    Log()->RenameEvent(GetMountPoint(), from, to, -EINVAL);
+    return Status::OK;
+  }
+  std::string from_full_path = PromoteToFullPath(from);
+  std::string to_full_path = PromoteToFullPath(to);
+  unsigned flags = request->no_replace() ? RENAME_NOREPLACE :
+    (request->exchange() ? RENAME_EXCHANGE : 0);
+
+  PathResolver::Location from_location;
+  PathResolver::Location to_location;
+  PersistentState::UpdateGroup group;
+  int err = resolver_.Resolve(from, &from_location);
+  if (err == 0) { err = resolver_.Resolve(to, &to_location); }
+  if (err == 0) { err = persistence_.BeginGroup(&group); }
+  if (err == 0) {
+    err = persistence_.StageRename(&group, from_full_path, from_location.GetDirFd(),
+      from_location.name, to_full_path, to_location.GetDirFd(), to_location.name, flags);
+  }
+  if (err == 0) { err = persistence_.CommitGroup(&group); }
+  if (err == 0) { err = group.GetResult(0); }
+
+  // either path may have been a directory or a cached file.
+  if (err == 0) {
+    resolver_.Invalidate(from);
+    resolver_.Invalidate(to);
+    files_.Invalidate(from_full_path);
+    files_.Invalidate(to_full_path);
+  }
+  Log()->RenameEvent(from_full_path, from, to, err);
   result->set_error_code(err);
   return Status::OK;
 }
 
+// adds one operation of an atomic batch to group. returns 0 or -errno.
+int FileService::StageBatchOp(const BatchOp& op, const PathResolver::Location& location,
+    PersistentState::UpdateGroup* group) {
+  std::string full_path = PromoteToFullPath(op.path());
+  struct stat stat_buffer;
+  int err;
+  switch (op.type()) {
+    case BatchOp::UPLOAD:
+      return persistence_.StageWrite(group, full_path, location.GetDirFd(), location.name,
+        op.contents().data(), op.contents().size());
+    case BatchOp::CREATE:
+      // the check only saves staging a doomed create; a file that appears
+      // before the group commits is kept, and the create fails then.
+      err = io_->Stat(location.GetDirFd(), location.name, &stat_buffer);
+      if (err == 0) { return -EEXIST; }
+      if (err != -ENOENT) { return err; }
+      return persistence_.StageWrite(group, full_path, location.GetDirFd(), location.name,
+        nullptr, 0, RENAME_NOREPLACE);
+    case BatchOp::REMOVE:
+      err = io_->Stat(location.GetDirFd(), location.name, &stat_buffer);
+      if (err != 0) { return err; }
+      if (S_ISDIR(stat_buffer.st_mode)) { return -EISDIR; }
+      return persistence_.StageRemove(group, full_path, location.GetDirFd(), location.name);
+    default:
+      return -EOPNOTSUPP;
+  }
+}
+
 // saves file to the local mount point and returns up to date time info.
 Status FileService::UploadFile(ServerContext* ctx, const FileData* file,
     FileInfo* info) {
   assert(file != nullptr && info != nullptr);
-  std::string full_path = PromoteToFullPath(file->path().data());
+  EventLog::StartCall();
+  std::string peer = GetPeer(ctx);
+
+  // refuse before the body is held any longer than it takes to say so.
+  AdmissionControl::Ticket ticket;
+  long bytes = file->contents().size();
+  long retry_ms = admission_.Admit(peer, bytes, true, &ticket);
+  if (retry_ms != 0) {
+    return Refuse(ctx, "UploadFile", PromoteToFullPath(file->path().data()),
+      file->path().data(), bytes, retry_ms);
+  }
+
+  RequestScheduler::Slot slot(&scheduler_, peer, RequestScheduler::kBulk);
+  slot.Charge(bytes);
+  UploadFile(file->path().data(), file->contents(), info);
+  return Status::OK;
+}
+
+// stages contents and replaces the file at path with it. info receives the
+// file's attributes afterwards. returns 0 or -errno.
+int FileService::UploadFile(const std::string& path, const std::string& contents,
+    FileInfo* info) {
+  std::string full_path = PromoteToFullPath(path);
   PersistentState::UpdateToken token(full_path);
+  PathResolver::Location location;
+  int err = resolver_.Resolve(path, &location);
+  if (err != 0) {
+    Log()->UploadFileEvent(full_path, path, contents, err);
+    info->set_error_code(err);
+    return err;
+  }
+  token.SetTargetLocation(location.GetDirFd(), location.name);
 
   if (!persistence_.CreateUpdateFile(full_path, &token)) {
-    int err = -errno;
-    Log()->UploadFileEvent(full_path, file->path().data(), file->contents(), err);
+    err = -errno;
+    Log()->UploadFileEvent(full_path, path, contents, err);
     info->set_error_code(err);
-    return Status::OK;
+    return err;
   }
 
-  if (crash_write_ && file->path().data() == "/crash-me") {
-    int crash_size = file->contents().size() > 2048 ? 1024 : file->contents().size() / 2;
-    token.GetStream()->write(file->contents().c_str(), crash_size);
-    token.GetStream()->flush();
+  if (crash_write_ && path == "/crash-me") {
+    int crash_size = contents.size() > 2048 ? 1024 : contents.size() / 2;
+    persistence_.WriteUpdate(&token, contents.c_str(), crash_size, false);
     assert(0 && "crash me detected");
   }
 
-  token.GetStream()->write(file->contents().c_str(), file->contents().size());
+  // write in chunks so that an upload overtaken by a newer upload of the
+  // same path stops early instead of staging a copy nobody will see. each
+  // chunk is hashed on its way to the disk.
+  static const size_t kChunkSize = 1 << 20;
+  Sha256 hash;
+  for (size_t offset = 0; offset < contents.size() && err == 0; offset += kChunkSize) {
+    if (persistence_.IsSuperseded(token)) {
+      persistence_.AbortUpdate(&token);
+      token.SetSuperseded();
+      break;
+    }
+    size_t size = std::min(kChunkSize, contents.size() - offset);
+    hash.Update(contents.c_str() + offset, size);
+    err = persistence_.WriteUpdate(&token, contents.c_str() + offset, size,
+      offset + size == contents.size());
+  }
 
-  if (token.GetStream()->bad()) {
-    int err = -errno;
-    Log()->UploadFileEvent(full_path, file->path().data(), file->contents(), err);
+  if (err != 0) {
+    persistence_.AbortUpdate(&token);
+    Log()->UploadFileEvent(full_path, path, contents, err);
     info->set_error_code(err);
-    return Status::OK;
+    return err;
   }
 
-  int err = persistence_.FinalizeUpdate(&token);
+  // the staged file keeps its inode and mtime when renamed into place, so
+  // its stat taken now is the key the hash is found by later.
+  struct stat staged;
+  bool indexed = !token.IsSuperseded() && fstat(token.GetFd(), &staged) == 0;
+  if (!token.IsSuperseded()) {
+    err = persistence_.FinalizeUpdate(&token);
+  }
+  if (err == 0 && !token.IsSuperseded()) {
+    files_.Invalidate(full_path);
+    if (indexed) { hashes_.Store(full_path, staged, hash.Final()); }
+  }
 
-  Log()->UploadFileEvent(full_path, file->path().data(), file->contents(), err);
-  GetFileInfo(full_path, file->path().data(), false, info);
-  return Status::OK;
+  if (token.IsSuperseded()) {
+    Log()->UploadSupersededEvent(full_path, path);
+  }
+  Log()->UploadFileEvent(full_path, path, contents, err);
+  GetFileInfo(location, full_path, path, false, info);
+  return err;
 }
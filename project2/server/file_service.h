@@ -2,19 +2,41 @@
 // by: allison morris
 
 
+#include <fstream>
 #include <grpc++/grpc++.h>
+#include <memory>
 
+#include "admission_control.h"
+#include "buffer_pool.h"
 #include "file.grpc.pb.h"
+#include "file_cache.h"
+#include "hash_index.h"
+#include "io_backend.h"
+#include "path_resolver.h"
 #include "persistent_state.h"
+#include "request_scheduler.h"
+#include "version_table.h"
 
 namespace File {
 
 class FileService : public BasicFileService::Service {
 public:
   FileService(const std::string& mount_point, const std::string& persistent_dir,
-    const std::string& persistent_store, bool crash)
-    : mount_point_(mount_point)
-    , persistence_(persistent_dir, persistent_store), crash_write_(crash) { }
+    const std::string& persistent_store, bool crash,
+    PersistentState::StagingMode staging = PersistentState::kJournalStaging,
+    IoBackend::Type io_type = IoBackend::kPosix,
+    long memory_limit = AdmissionControl::kDefaultByteLimit, bool arenas = false,
+    int bulk_slots = 0)
+    : mount_point_(mount_point), resolver_(mount_point), io_(IoBackend::Create(io_type))
+    , files_(io_.get()), persistence_(persistent_dir, persistent_store, io_.get(), staging)
+    , hashes_(persistent_store + ".hashes"), scheduler_(0, bulk_slots)
+    , admission_(memory_limit), crash_write_(crash), arenas_(arenas) { }
+
+  grpc::Status Batch(grpc::ServerContext* ctx, const BatchRequest* request,
+    BatchReply* reply) override;
+
+  grpc::Status Copy(grpc::ServerContext* ctx, const CopyRequest* request,
+    FileInfo* info) override;
 
   grpc::Status CreateDirectory(grpc::ServerContext* ctx, const Path* path,
     Result* result) override;
@@ -25,12 +47,21 @@ public:
   grpc::Status DownloadFile(grpc::ServerContext* ctx, const Path* path,
     File* file) override;
 
+  grpc::Status DownloadFileStream(grpc::ServerContext* ctx, const Path* path,
+    grpc::ServerWriter<FileChunk>* writer) override;
+
+  grpc::Status DownloadRange(grpc::ServerContext* ctx, const ReadRequest* request,
+    grpc::ServerWriter<FileChunk>* writer) override;
+
   grpc::Status GetDirectoryContents(grpc::ServerContext* ctx, const Path* path,
     DirInfo* info) override;
 
   grpc::Status GetFileInfo(grpc::ServerContext* ctx, const Path* path,
     FileInfo* info) override;
 
+  grpc::Status GetServerStats(grpc::ServerContext* ctx, const StatsRequest* request,
+    ServerStats* stats) override;
+
   bool Initialize();
 
   grpc::Status RemoveDirectory(grpc::ServerContext* ctx, const Path* path,
@@ -39,27 +70,81 @@ public:
   grpc::Status RemoveFile(grpc::ServerContext* ctx, const Path* path,
     Result* result) override;
 
+  grpc::Status Rename(grpc::ServerContext* ctx, const RenameRequest* request,
+    Result* result) override;
+
   grpc::Status UploadFile(grpc::ServerContext* ctx, const FileData* file,
     FileInfo* info) override;
 private:
-  bool FileExists(const std::string& full_path) const;
+  // serves raw ranged reads with the same files, versions and limits.
+  friend class DataPlane;
 
-  int GetError(int ret) const;
+  // the size of the chunks that streamed downloads send. one chunk is held
+  // in memory at a time.
+  static const size_t kStreamChunkSize = 256 * 1024;
+
+  // these do the work of the rpcs of the same name, for a single rpc or for
+  // one operation of a batch. they return 0 or -errno.
+  int CreateDirectory(const std::string& path);
+
+  int CreateFile(const std::string& path);
+
+  int RemoveDirectory(const std::string& path);
 
-  bool GetFileInfo(const std::string& full_path, const std::string& path, 
-    bool top_level, FileInfo* info) const;
+  int RemoveFile(const std::string& path);
 
-  bool GetIfstream(const std::string& full_path, std::ifstream* stream) const;
+  int UploadFile(const std::string& path, const std::string& contents, FileInfo* info);
+
+  int GetError(int ret) const;
+
+  bool GetFileInfo(const PathResolver::Location& location,
+    const std::string& full_path, const std::string& path, bool top_level,
+    FileInfo* info) const;
 
   const std::string& GetMountPoint() const { return mount_point_; }
 
   bool GetOfstream(const std::string& full_path, std::ofstream* stream) const;
 
+  std::string GetPeer(grpc::ServerContext* ctx) const;
+
+  // opens path for a ranged read. a version of 0 opens the current file and
+  // pins it, setting version; any other finds that pinned version. returns
+  // 0 or -errno.
+  int OpenRange(const std::string& path, const std::string& full_path, uint64_t* version,
+    std::shared_ptr<FileHandle>* handle, struct stat* stat_buffer);
+
   std::string PromoteToFullPath(const std::string& suffix) const;
 
+  grpc::Status Refuse(grpc::ServerContext* ctx, const std::string& rpc,
+    const std::string& full_path, const std::string& path, long bytes, long retry_ms);
+
+  grpc::Status RunAtomicBatch(const BatchRequest& request, BatchReply* reply);
+
+  // streams the bytes of fd from offset up to end, the first chunk
+  // carrying whatever chunk already holds. sent receives the number of
+  // bytes sent. returns 0 or -errno.
+  int SendChunks(grpc::ServerContext* ctx, int fd, off_t offset, off_t end,
+    FileChunk* chunk, grpc::ServerWriter<FileChunk>* writer,
+    RequestScheduler::Slot* slot, off_t* sent, int* window);
+
+  void SetFileInfo(const struct stat& stat_buffer, const std::string& full_path,
+    const std::string& path, bool top_level, FileInfo* info) const;
+
+  int StageBatchOp(const BatchOp& op, const PathResolver::Location& location,
+    PersistentState::UpdateGroup* group);
+
   std::string mount_point_;
+  PathResolver resolver_;
+  std::unique_ptr<IoBackend> io_;
+  FileCache files_;
+  VersionTable versions_;
   PersistentState persistence_;
+  HashIndex hashes_;
+  RequestScheduler scheduler_;
+  AdmissionControl admission_;
   bool crash_write_;
+  // build streamed chunks on a CallArena and recycle their bodies.
+  bool arenas_;
 };
 
 }
@@ -1,7 +1,13 @@
 // filed.cc : this is the point-of-entry for the file server.
 // by: allison morris
 
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <grpc++/resource_quota.h>
+#include <sys/resource.h>
 #include "arguments.h"
+#include "data_plane.h"
 #include "event_log.h"
 #include "file_service.h"
 
@@ -21,14 +27,36 @@ int main(int argc, const char** argv) {
   }
 
   EventLog::Initialize(std::cerr, args.GetVerbosity(), args.GetDumpFiles());
+  std::ofstream trace;
+  if (!args.GetTraceFile().empty()) {
+    trace.open(args.GetTraceFile());
+    if (!trace) {
+      std::cerr << "could not open trace file " << args.GetTraceFile() << "\n";
+      return -1;
+    }
+    Log()->StartTrace(&trace);
+  }
 
   std::string address = "0.0.0.0:";
   address += std::to_string(args.GetPort());
 
   Log()->StartupEvent(args.GetMountPoint(), address);
 
+  // cached files, pinned versions and clients each hold a descriptor, and
+  // the default soft limit of 1024 is easily reached. go as high as allowed.
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  long memory_limit = args.GetMemoryLimit() << 20;
   FileService service(args.GetMountPoint(), args.GetPersistentDirectory(),
-    args.GetPersistentStoreName(), args.GetCrashWrite());
+    args.GetPersistentStoreName(), args.GetCrashWrite(),
+    args.GetTmpFileStaging() ? PersistentState::kAnonymousStaging
+    : PersistentState::kJournalStaging,
+    args.GetUringIo() ? IoBackend::kUring : IoBackend::kPosix,
+    memory_limit, args.GetArenas(), args.GetBulkSlots());
   if (!service.Initialize()) {
     return -1;
   }
@@ -36,7 +64,29 @@ int main(int argc, const char** argv) {
   ServerBuilder builder;
   builder.AddListeningPort(address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
-  builder.BuildAndStart()->Wait();
+
+  // grpc receives and parses a whole request before FileService can admit
+  // or refuse it, so the memory limit is also enforced as it is received:
+  // no message may be larger than the limit, and the buffers of all
+  // connections together are held to it, pushing back on the senders.
+  builder.SetMaxReceiveMessageSize((int)std::min<long>(memory_limit, INT_MAX));
+  grpc::ResourceQuota quota("filed");
+  quota.Resize(memory_limit);
+  builder.SetResourceQuota(quota);
+
+  // bulk reads can also skip protobuf through the generic data plane.
+  DataPlane data_plane(&service);
+  std::unique_ptr<grpc::ServerCompletionQueue> data_queue;
+  if (args.GetDataPlane()) {
+    builder.RegisterAsyncGenericService(data_plane.GetService());
+    data_queue = builder.AddCompletionQueue();
+  }
+
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  if (data_queue != nullptr) {
+    data_plane.Start(std::move(data_queue), DataPlane::kDefaultThreads);
+  }
+  server->Wait();
   
   // TODO: store server pointer and implement shutdown.
   // NOTE: this function will not return until shutdown is implemented.
@@ -0,0 +1,139 @@
+// hash_index.cc : implements HashIndex.
+// by: allison morris
+
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include "hash_index.h"
+#include "sha256.h"
+
+using namespace File;
+
+namespace {
+
+// converts hex back into a digest. returns false if hex is malformed.
+bool FromHex(const std::string& hex, std::string* digest) {
+  if (hex.size() != Sha256::kDigestSize * 2) { return false; }
+  digest->clear();
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int value;
+    if (std::sscanf(hex.c_str() + i, "%2x", &value) != 1) { return false; }
+    *digest += (char)value;
+  }
+  return true;
+}
+
+}
+
+HashIndex::HashIndex(const std::string& index_path)
+    : index_path_(index_path), fd_(-1), records_(0) { }
+
+HashIndex::~HashIndex() {
+  if (fd_ >= 0) { close(fd_); }
+}
+
+bool HashIndex::Find(const struct stat& st, std::string* digest) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(MakeKey(st));
+  if (iter == entries_.end()) { return false; }
+  *digest = iter->second.digest;
+  return true;
+}
+
+bool HashIndex::Load() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ifstream log(index_path_);
+  std::string line;
+  while (std::getline(log, line)) {
+    std::istringstream fields(line);
+    Key key;
+    std::string hex;
+    Entry entry;
+    fields >> key.inode >> key.mtime_sec >> key.mtime_nsec >> key.size >> hex;
+    if (!fields || fields.get() != ' ' || !std::getline(fields, entry.path) ||
+        !FromHex(hex, &entry.digest)) {
+      continue;
+    }
+    // later records for a path replace earlier ones.
+    Insert(entry.path, key, entry.digest);
+  }
+
+  for (auto iter = entries_.begin(); iter != entries_.end();) {
+    struct stat st;
+    if (stat(iter->second.path.c_str(), &st) != 0 || !(MakeKey(st) == iter->first)) {
+      paths_.erase(iter->second.path);
+      iter = entries_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  return Rewrite();
+}
+
+HashIndex::Entry& HashIndex::Insert(const std::string& path, const Key& key,
+    const std::string& digest) {
+  auto old = paths_.find(path);
+  if (old != paths_.end()) {
+    auto iter = entries_.find(old->second);
+    if (iter != entries_.end() && iter->second.path == path) { entries_.erase(iter); }
+  }
+  // a file seen under a new path, after a rename, moves to that path.
+  auto moved = entries_.find(key);
+  if (moved != entries_.end()) { paths_.erase(moved->second.path); }
+
+  paths_[path] = key;
+  Entry& entry = entries_[key];
+  entry.digest = digest;
+  entry.path = path;
+  return entry;
+}
+
+HashIndex::Key HashIndex::MakeKey(const struct stat& st) {
+  Key key;
+  key.inode = st.st_ino;
+  key.mtime_sec = st.st_mtim.tv_sec;
+  key.mtime_nsec = st.st_mtim.tv_nsec;
+  key.size = st.st_size;
+  return key;
+}
+
+bool HashIndex::Rewrite() {
+  std::string contents;
+  for (const auto& entry : entries_) { contents += ToRecord(entry.first, entry.second); }
+
+  std::string temp_path = index_path_ + ".new";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) { return false; }
+  bool good = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size() &&
+    fdatasync(fd) == 0;
+  close(fd);
+  if (!good || rename(temp_path.c_str(), index_path_.c_str()) != 0) { return false; }
+
+  if (fd_ >= 0) { close(fd_); }
+  fd_ = open(index_path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  records_ = entries_.size();
+  return fd_ >= 0;
+}
+
+void HashIndex::Store(const std::string& full_path, const struct stat& st,
+    const std::string& digest) {
+  Key key = MakeKey(st);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Entry& entry = Insert(full_path, key, digest);
+  if (fd_ < 0) { return; }
+  if (records_ >= 2 * entries_.size() + 1024) {
+    Rewrite();
+    return;
+  }
+  std::string record = ToRecord(key, entry);
+  if (write(fd_, record.data(), record.size()) == (ssize_t)record.size()) { ++records_; }
+}
+
+std::string HashIndex::ToRecord(const Key& key, const Entry& entry) const {
+  std::ostringstream record;
+  record << key.inode << " " << key.mtime_sec << " " << key.mtime_nsec << " " << key.size
+    << " " << Sha256::ToHex(entry.digest) << " " << entry.path << "\n";
+  return record.str();
+}
@@ -0,0 +1,89 @@
+// hash_index.h : declares HashIndex, which remembers the content hashes of
+// files the server has written or read in full.
+// by: allison morris
+
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace File {
+
+// maps a file's identity, its inode, modification time and size, to the
+// sha-256 of its contents. a hash is looked up by stat alone, so reporting
+// it costs no reads; any write to the file changes its mtime and so
+// invalidates the entry without the index having to be told.
+//
+// entries are appended to a log next to the persistent store, one line of
+// "<inode> <mtime sec> <mtime nsec> <size> <hex digest> <path>" each, and
+// read back on startup. the log is rewritten without dead entries when
+// loaded and whenever it grows to twice the live ones. losing the tail of
+// the log in a crash only loses hashes, which are recomputed on the next
+// full read.
+class HashIndex {
+public:
+  explicit HashIndex(const std::string& index_path);
+
+  ~HashIndex();
+
+  // returns true and fills digest if the file with attributes st is indexed.
+  bool Find(const struct stat& st, std::string* digest) const;
+
+  // reads the log. entries whose full path no longer names the file they
+  // were recorded for are dropped. returns false if the log cannot be
+  // written.
+  bool Load();
+
+  // records digest as the hash of the file at full_path with attributes
+  // st, replacing whatever was recorded for full_path before.
+  void Store(const std::string& full_path, const struct stat& st, const std::string& digest);
+private:
+  struct Key {
+    ino_t inode;
+    time_t mtime_sec;
+    long mtime_nsec;
+    off_t size;
+
+    bool operator==(const Key& other) const {
+      return inode == other.inode && mtime_sec == other.mtime_sec &&
+        mtime_nsec == other.mtime_nsec && size == other.size;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<ino_t>()(key.inode) ^ std::hash<long>()(key.mtime_nsec);
+    }
+  };
+
+  struct Entry {
+    std::string digest;
+    std::string path;
+  };
+
+  // records digest for key under path, dropping what path and key were
+  // recorded with before. mutex_ must be held.
+  Entry& Insert(const std::string& path, const Key& key, const std::string& digest);
+
+  static Key MakeKey(const struct stat& st);
+
+  // rewrites the log from entries_. mutex_ must be held.
+  bool Rewrite();
+
+  std::string ToRecord(const Key& key, const Entry& entry) const;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  std::unordered_map<std::string, Key> paths_;
+  std::string index_path_;
+  int fd_;
+  size_t records_;
+};
+
+}
+
+#endif
@@ -0,0 +1,481 @@
+// io_backend.cc : posix and io_uring implementations of IoBackend.
+// by: allison morris
+
+// the io_uring backend talks to the kernel directly instead of through
+// liburing: each thread maps its own submission and completion rings the
+// first time it does i/o, fills in a batch of entries, and submits and
+// waits for the whole batch with one io_uring_enter. nothing is shared
+// between threads, so no locking is needed around the rings.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#include "io_backend.h"
+
+using namespace File;
+
+namespace {
+
+class PosixIoBackend : public IoBackend {
+public:
+  // buffer used when the kernel cannot copy between the two files.
+  static const size_t kCopyBufferSize = 1 << 20;
+
+  int Close(int fd) override {
+    return close(fd) == 0 ? 0 : -errno;
+  }
+
+  int Copy(int from_fd, int to_fd, off_t size, bool* cloned) override {
+    if (cloned != nullptr) { *cloned = false; }
+    if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+      if (cloned != nullptr) { *cloned = true; }
+      return 0;
+    }
+
+    // copy_file_range refuses some pairs of file systems and older kernels
+    // lack it; both show up on the first call, before anything is written.
+    loff_t from_offset = 0;
+    loff_t to_offset = 0;
+    while (from_offset < size) {
+      ssize_t copied = copy_file_range(from_fd, &from_offset, to_fd, &to_offset,
+        size - from_offset, 0);
+      if (copied < 0) {
+        if (errno == EINTR) { continue; }
+        if (from_offset == 0 && (errno == EXDEV || errno == ENOSYS ||
+            errno == EINVAL || errno == EOPNOTSUPP)) { break; }
+        return -errno;
+      }
+      // the source was truncated under us.
+      if (copied == 0) { return 0; }
+    }
+    if (from_offset > 0 || size == 0) { return 0; }
+
+    std::vector<char> buffer(std::min<size_t>(kCopyBufferSize, size));
+    for (off_t offset = 0; offset < size;) {
+      ssize_t got = Read(from_fd, buffer.data(), std::min<off_t>(buffer.size(),
+        size - offset), offset);
+      if (got < 0) { return got; }
+      if (got == 0) { break; }
+      int err = Write(to_fd, buffer.data(), got, offset, false);
+      if (err != 0) { return err; }
+      offset += got;
+    }
+    return 0;
+  }
+
+  const char* GetName() const override { return "posix"; }
+
+  int MakeDirectory(int dir_fd, const std::string& path, mode_t mode) override {
+    return mkdirat(dir_fd, path.c_str(), mode) == 0 ? 0 : -errno;
+  }
+
+  int Open(int dir_fd, const std::string& path, int flags, mode_t mode) override {
+    int fd = openat(dir_fd, path.c_str(), flags | O_NOFOLLOW, mode);
+    return fd >= 0 ? fd : -errno;
+  }
+
+  ssize_t Read(int fd, char* buffer, size_t size, off_t offset) override {
+    ssize_t ret;
+    do { ret = pread(fd, buffer, size, offset); } while (ret < 0 && errno == EINTR);
+    return ret >= 0 ? ret : -errno;
+  }
+
+  int ReadAll(int fd, std::string* contents) override {
+    struct stat st;
+    if (fstat(fd, &st) != 0) { return -errno; }
+    contents->resize(st.st_size);
+    size_t total = 0;
+    while (true) {
+      if (total == contents->size()) { contents->resize(total + 4096); }
+      ssize_t ret = Read(fd, &(*contents)[total], contents->size() - total, total);
+      if (ret < 0) { return ret; }
+      if (ret == 0) { break; }
+      total += ret;
+    }
+    contents->resize(total);
+    return 0;
+  }
+
+  int Rename(int from_dir_fd, const std::string& from, int to_dir_fd,
+      const std::string& to, unsigned flags) override {
+    int ret = flags == 0 ? renameat(from_dir_fd, from.c_str(), to_dir_fd, to.c_str())
+      : renameat2(from_dir_fd, from.c_str(), to_dir_fd, to.c_str(), flags);
+    return ret == 0 ? 0 : -errno;
+  }
+
+  int Stat(int dir_fd, const std::string& path, struct stat* st) override {
+    return fstatat(dir_fd, path.c_str(), st, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno;
+  }
+
+  int Sync(int fd) override {
+    return fdatasync(fd) == 0 ? 0 : -errno;
+  }
+
+  int Unlink(int dir_fd, const std::string& path, int flags) override {
+    return unlinkat(dir_fd, path.c_str(), flags) == 0 ? 0 : -errno;
+  }
+
+  int Write(int fd, const char* data, size_t size, off_t offset, bool sync) override {
+    while (size > 0) {
+      ssize_t written = pwrite(fd, data, size, offset);
+      if (written < 0) {
+        if (errno == EINTR) { continue; }
+        return -errno;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+    }
+    return sync ? Sync(fd) : 0;
+  }
+};
+
+// one thread's io_uring. entries are prepared with NextEntry and handed to
+// the kernel together by SubmitAndWait.
+class UringQueue {
+public:
+  static const unsigned kDepth = 64;
+
+  ~UringQueue() {
+    if (sqes_ != MAP_FAILED) { munmap(sqes_, sqes_size_); }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) { munmap(cq_ring_, cq_ring_size_); }
+    if (sq_ring_ != MAP_FAILED) { munmap(sq_ring_, sq_ring_size_); }
+    if (fd_ >= 0) { close(fd_); }
+  }
+
+  // returns the calling thread's queue, setting it up on first use. returns
+  // nullptr if the kernel does not allow io_uring.
+  static UringQueue* ForThread() {
+    static thread_local std::unique_ptr<UringQueue> queue;
+    static thread_local bool failed = false;
+    if (!queue && !failed) {
+      queue.reset(new UringQueue());
+      if (!queue->Setup()) {
+        queue.reset();
+        failed = true;
+      }
+    }
+    return queue.get();
+  }
+
+  unsigned GetSpace() const { return kDepth - pending_; }
+
+  // returns a cleared entry. its result lands at the entry's position in the
+  // batch within the vector filled by SubmitAndWait.
+  io_uring_sqe* NextEntry(unsigned char opcode, int fd, const void* addr,
+      unsigned len, unsigned long long offset) {
+    unsigned tail = *sq_tail_ + pending_;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = pending_;
+    sq_array_[index] = index;
+    ++pending_;
+    return sqe;
+  }
+
+  // submits every prepared entry and blocks until all of them complete.
+  // results[i] receives the result of the i-th entry. returns -errno if the
+  // ring itself failed.
+  int SubmitAndWait(std::vector<int>* results) {
+    unsigned count = pending_;
+    results->assign(count, -ECANCELED);
+    __atomic_store_n(sq_tail_, *sq_tail_ + count, __ATOMIC_RELEASE);
+    pending_ = 0;
+
+    unsigned to_submit = count, completed = 0;
+    while (completed < count) {
+      int ret = syscall(__NR_io_uring_enter, fd_, to_submit, count - completed,
+        IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR) { continue; }
+        return -errno;
+      }
+      to_submit -= std::min<unsigned>(ret, to_submit);
+
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+        if (cqe->user_data < count) { (*results)[cqe->user_data] = cqe->res; }
+        ++completed;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+  }
+private:
+  UringQueue() : fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED),
+    sqes_((io_uring_sqe*)MAP_FAILED), pending_(0) { }
+
+  bool Setup() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, kDepth, &params);
+    if (fd_ < 0) { return false; }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) { return false; }
+    cq_ring_ = single_mmap ? sq_ring_ : mmap(nullptr, cq_ring_size_,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) { return false; }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) { return false; }
+
+    char* sq = (char*)sq_ring_;
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)cq_ring_;
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  int fd_;
+  void* sq_ring_;
+  void* cq_ring_;
+  io_uring_sqe* sqes_;
+  io_uring_cqe* cqes_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  unsigned pending_;
+};
+
+class UringIoBackend : public IoBackend {
+public:
+  // largest read or write placed in a single entry.
+  static const size_t kPieceSize = 256 * 1024;
+
+  int Close(int fd) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Close(fd); }
+    queue->NextEntry(IORING_OP_CLOSE, fd, nullptr, 0, 0);
+    return SubmitOne(queue);
+  }
+
+  // io_uring has no clone or copy_file_range operation.
+  int Copy(int from_fd, int to_fd, off_t size, bool* cloned) override {
+    return posix_.Copy(from_fd, to_fd, size, cloned);
+  }
+
+  const char* GetName() const override { return "io_uring"; }
+
+  int MakeDirectory(int dir_fd, const std::string& path, mode_t mode) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.MakeDirectory(dir_fd, path, mode); }
+    queue->NextEntry(IORING_OP_MKDIRAT, dir_fd, path.c_str(), mode, 0);
+    return SubmitOne(queue);
+  }
+
+  int Open(int dir_fd, const std::string& path, int flags, mode_t mode) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Open(dir_fd, path, flags, mode); }
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_OPENAT, dir_fd, path.c_str(), mode, 0);
+    sqe->open_flags = flags | O_NOFOLLOW;
+    return SubmitOne(queue);
+  }
+
+  ssize_t Read(int fd, char* buffer, size_t size, off_t offset) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Read(fd, buffer, size, offset); }
+    queue->NextEntry(IORING_OP_READ, fd, buffer, size, offset);
+    return SubmitOne(queue);
+  }
+
+  // sizes the file with statx and then reads all of its pieces in parallel,
+  // a ring's worth per submission.
+  int ReadAll(int fd, std::string* contents) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.ReadAll(fd, contents); }
+    struct statx stx;
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_STATX, fd, "", STATX_SIZE,
+      (unsigned long long)&stx);
+    sqe->statx_flags = AT_EMPTY_PATH;
+    int err = SubmitOne(queue);
+    if (err != 0) { return err; }
+
+    contents->resize(stx.stx_size);
+    size_t offset = 0;
+    std::vector<int> results;
+    while (offset < contents->size()) {
+      size_t batch_start = offset;
+      while (offset < contents->size() && queue->GetSpace() > 0) {
+        size_t size = std::min(kPieceSize, contents->size() - offset);
+        queue->NextEntry(IORING_OP_READ, fd, &(*contents)[offset], size, offset);
+        offset += size;
+      }
+      err = queue->SubmitAndWait(&results);
+      if (err != 0) { return err; }
+      size_t expected = batch_start;
+      for (int ret : results) {
+        if (ret < 0) { return ret; }
+        size_t size = std::min(kPieceSize, contents->size() - expected);
+        if ((size_t)ret < size) {
+          // the file shrank under us. keep what was read contiguously.
+          contents->resize(expected + ret);
+          return 0;
+        }
+        expected += size;
+      }
+    }
+    return 0;
+  }
+
+  int Rename(int from_dir_fd, const std::string& from, int to_dir_fd,
+      const std::string& to, unsigned flags) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Rename(from_dir_fd, from, to_dir_fd, to, flags); }
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_RENAMEAT, from_dir_fd, from.c_str(),
+      to_dir_fd, (unsigned long long)to.c_str());
+    sqe->rename_flags = flags;
+    return SubmitOne(queue);
+  }
+
+  int Stat(int dir_fd, const std::string& path, struct stat* st) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Stat(dir_fd, path, st); }
+    struct statx stx;
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_STATX, dir_fd, path.c_str(),
+      STATX_BASIC_STATS, (unsigned long long)&stx);
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    int err = SubmitOne(queue);
+    if (err != 0) { return err; }
+
+    std::memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+  }
+
+  int Sync(int fd) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Sync(fd); }
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_FSYNC, fd, nullptr, 0, 0);
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    return SubmitOne(queue);
+  }
+
+  int Unlink(int dir_fd, const std::string& path, int flags) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Unlink(dir_fd, path, flags); }
+    io_uring_sqe* sqe = queue->NextEntry(IORING_OP_UNLINKAT, dir_fd, path.c_str(), 0, 0);
+    sqe->unlink_flags = flags;
+    return SubmitOne(queue);
+  }
+
+  // submits the pieces of data as a linked chain of writes, with the sync
+  // linked behind the last one, so the whole sequence is one submission and
+  // the sync only runs if every write completed in full.
+  int Write(int fd, const char* data, size_t size, off_t offset, bool sync) override {
+    UringQueue* queue = UringQueue::ForThread();
+    if (queue == nullptr) { return posix_.Write(fd, data, size, offset, sync); }
+
+    std::vector<int> results;
+    while (size > 0 || sync) {
+      std::vector<size_t> sizes;
+      io_uring_sqe* last = nullptr;
+      size_t batch = 0;
+      while (batch < size && queue->GetSpace() > 1) {
+        if (last != nullptr) { last->flags |= IOSQE_IO_LINK; }
+        size_t piece = std::min(kPieceSize, size - batch);
+        last = queue->NextEntry(IORING_OP_WRITE, fd, data + batch, piece, offset + batch);
+        sizes.push_back(piece);
+        batch += piece;
+      }
+      bool sync_now = sync && batch == size;
+      if (sync_now) {
+        if (last != nullptr) { last->flags |= IOSQE_IO_LINK; }
+        io_uring_sqe* sqe = queue->NextEntry(IORING_OP_FSYNC, fd, nullptr, 0, 0);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      }
+
+      int err = queue->SubmitAndWait(&results);
+      if (err != 0) { return err; }
+
+      // a short write breaks the chain. finish the rest synchronously.
+      size_t done = 0;
+      for (size_t i = 0; i < sizes.size(); ++i) {
+        if (results[i] < 0 && results[i] != -ECANCELED) { return results[i]; }
+        if (results[i] < 0 || (size_t)results[i] < sizes[i]) {
+          if (results[i] > 0) { done += results[i]; }
+          return posix_.Write(fd, data + done, size - done, offset + done, sync);
+        }
+        done += sizes[i];
+      }
+      if (sync_now) { return results.back() < 0 ? results.back() : 0; }
+      data += done;
+      size -= done;
+      offset += done;
+    }
+    return 0;
+  }
+private:
+  int SubmitOne(UringQueue* queue) {
+    std::vector<int> results;
+    int err = queue->SubmitAndWait(&results);
+    return err != 0 ? err : results[0];
+  }
+
+  PosixIoBackend posix_;
+};
+
+const size_t PosixIoBackend::kCopyBufferSize;
+const size_t UringIoBackend::kPieceSize;
+
+}
+
+IoBackend* IoBackend::Create(Type type) {
+  if (type == kUring && UringQueue::ForThread() != nullptr) {
+    return new UringIoBackend();
+  }
+  return new PosixIoBackend();
+}
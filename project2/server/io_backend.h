@@ -0,0 +1,70 @@
+// io_backend.h : declares IoBackend, the file i/o used by the server.
+// by: allison morris
+
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace File {
+
+// all calls return 0 (or a descriptor / byte count) on success and -errno on
+// failure. paths are resolved relative to the given directory descriptor,
+// which may be AT_FDCWD. the posix backend blocks in one system call per
+// operation. the io_uring backend gives each thread its own ring and submits
+// the pieces of an operation as one batch, so a multi-chunk read or a write
+// followed by a sync costs a single io_uring_enter.
+class IoBackend {
+public:
+  enum Type { kPosix, kUring };
+
+  virtual ~IoBackend() { }
+
+  // returns a backend of the requested type. falls back to posix if the
+  // kernel refuses to set up an io_uring.
+  static IoBackend* Create(Type type);
+
+  virtual int Close(int fd) = 0;
+
+  // copies size bytes of from_fd into the empty file to_fd. the data is
+  // cloned (FICLONE) when the file system can share extents between files,
+  // else copied inside the kernel with copy_file_range, else through a
+  // buffer. cloned, if given, is set to whether the data was cloned.
+  virtual int Copy(int from_fd, int to_fd, off_t size, bool* cloned) = 0;
+
+  virtual const char* GetName() const = 0;
+
+  virtual int MakeDirectory(int dir_fd, const std::string& path, mode_t mode) = 0;
+
+  // Open and Stat do not follow a symlink in the last component of path,
+  // so that one under the mount point cannot lead a request outside it.
+  // opening one fails with -ELOOP, and Stat describes the link itself.
+  virtual int Open(int dir_fd, const std::string& path, int flags, mode_t mode) = 0;
+
+  virtual ssize_t Read(int fd, char* buffer, size_t size, off_t offset) = 0;
+
+  // reads the whole file behind fd into contents.
+  virtual int ReadAll(int fd, std::string* contents) = 0;
+
+  // renameat2 with the given RENAME_* flags.
+  virtual int Rename(int from_dir_fd, const std::string& from, int to_dir_fd,
+    const std::string& to, unsigned flags) = 0;
+
+  virtual int Stat(int dir_fd, const std::string& path, struct stat* st) = 0;
+
+  virtual int Sync(int fd) = 0;
+
+  // unlinkat with the given AT_* flags, e.g. AT_REMOVEDIR.
+  virtual int Unlink(int dir_fd, const std::string& path, int flags) = 0;
+
+  // writes all of data at offset and, if sync is set, syncs the file's data
+  // once the writes have finished.
+  virtual int Write(int fd, const char* data, size_t size, off_t offset,
+    bool sync) = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,154 @@
+// path_resolver.cc : implements PathResolver.
+// by: allison morris
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include "path_resolver.h"
+
+using namespace File;
+
+namespace {
+
+// splits path into its components, dropping empty ones and ".". returns
+// false if any component is "..".
+bool SplitPath(const std::string& path, std::vector<std::string>* parts) {
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) { end = path.size(); }
+    std::string part = path.substr(start, end - start);
+    if (part == "..") { return false; }
+    if (!part.empty() && part != ".") { parts->push_back(std::move(part)); }
+    start = end + 1;
+  }
+  return true;
+}
+
+}
+
+DirHandle::~DirHandle() {
+  if (fd_ >= 0) { close(fd_); }
+}
+
+std::shared_ptr<DirHandle> PathResolver::Find(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(key);
+  if (iter == entries_.end()) { return std::shared_ptr<DirHandle>(); }
+  lru_.splice(lru_.begin(), lru_, iter->second.lru);
+  return iter->second.dir;
+}
+
+bool PathResolver::Initialize() {
+  int fd = open(mount_point_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) { return false; }
+  root_ = std::make_shared<DirHandle>(fd);
+  return true;
+}
+
+void PathResolver::Invalidate(const std::string& path) {
+  std::string key = Normalize(path);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto iter = entries_.begin(); iter != entries_.end();) {
+    const std::string& cached = iter->first;
+    if (key.empty() || cached == key ||
+        (cached.size() > key.size() && cached.compare(0, key.size(), key) == 0 &&
+         cached[key.size()] == '/')) {
+      lru_.erase(iter->second.lru);
+      iter = entries_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+std::string PathResolver::Normalize(const std::string& path) {
+  std::vector<std::string> parts;
+  if (!SplitPath(path, &parts)) { return path; }
+  std::string key;
+  for (const std::string& part : parts) {
+    if (!key.empty()) { key += '/'; }
+    key += part;
+  }
+  return key;
+}
+
+// opens the directory named by key, a '/'-joined list of components below
+// the mount point. starts from the deepest cached ancestor and caches every
+// directory it opens on the way down.
+int PathResolver::OpenDirectory(const std::string& key, std::shared_ptr<DirHandle>* dir) {
+  *dir = Find(key);
+  if (*dir) { return 0; }
+
+  size_t done = key.size();
+  std::shared_ptr<DirHandle> current;
+  while (!current) {
+    done = key.rfind('/', done - 1);
+    if (done == std::string::npos || done == 0) {
+      done = 0;
+      current = root_;
+      break;
+    }
+    current = Find(key.substr(0, done));
+  }
+
+  size_t start = done == 0 ? 0 : done + 1;
+  while (start < key.size()) {
+    size_t end = key.find('/', start);
+    if (end == std::string::npos) { end = key.size(); }
+    std::string part = key.substr(start, end - start);
+    int fd = openat(current->GetFd(), part.c_str(),
+      O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) { return -errno; }
+    current = std::make_shared<DirHandle>(fd);
+    Store(key.substr(0, end), current);
+    start = end + 1;
+  }
+  *dir = current;
+  return 0;
+}
+
+int PathResolver::Resolve(const std::string& path, Location* location) {
+  std::vector<std::string> parts;
+  if (!SplitPath(path, &parts)) { return -EACCES; }
+  if (parts.empty()) {
+    location->dir = root_;
+    location->name = ".";
+    return 0;
+  }
+
+  location->name = parts.back();
+  parts.pop_back();
+  if (parts.empty()) {
+    location->dir = root_;
+    return 0;
+  }
+
+  std::string key = parts[0];
+  for (size_t i = 1; i < parts.size(); ++i) {
+    key += '/';
+    key += parts[i];
+  }
+  return OpenDirectory(key, &location->dir);
+}
+
+void PathResolver::Store(const std::string& key, const std::shared_ptr<DirHandle>& dir) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(key);
+  if (iter != entries_.end()) {
+    iter->second.dir = dir;
+    lru_.splice(lru_.begin(), lru_, iter->second.lru);
+    return;
+  }
+
+  lru_.push_front(key);
+  Entry& entry = entries_[key];
+  entry.dir = dir;
+  entry.lru = lru_.begin();
+  while (entries_.size() > kCapacity) {
+    entries_.erase(lru_.back());
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,92 @@
+// path_resolver.h : declares PathResolver, which maps client paths onto
+// cached directory descriptors under the mount point.
+// by: allison morris
+
+#ifndef PATH_RESOLVER_H
+#define PATH_RESOLVER_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace File {
+
+// an open directory. the descriptor is closed when the last user lets go,
+// so an entry evicted from the cache stays usable by requests holding it.
+class DirHandle {
+public:
+  explicit DirHandle(int fd) : fd_(fd) { }
+
+  ~DirHandle();
+
+  int GetFd() const { return fd_; }
+private:
+  DirHandle(const DirHandle&);
+  DirHandle& operator=(const DirHandle&);
+
+  int fd_;
+};
+
+// resolves client paths to (directory descriptor, entry name) pairs so that
+// file operations can use the *at system calls. the mount point and the
+// most recently used directories below it stay open, so a request for a
+// deep path only walks the components that are not already cached. paths
+// containing ".." are refused and intermediate directories are opened with
+// O_NOFOLLOW. IoBackend does not follow the final component either, so
+// requests cannot reach outside the mount point through a symlink.
+class PathResolver {
+public:
+  struct Location {
+    std::shared_ptr<DirHandle> dir;
+    std::string name;
+
+    int GetDirFd() const { return dir->GetFd(); }
+  };
+
+  static const size_t kCapacity = 256;
+
+  explicit PathResolver(const std::string& mount_point)
+    : mount_point_(mount_point) { }
+
+  bool Initialize();
+
+  // forgets path and every cached directory below it. call when a directory
+  // is removed or renamed.
+  void Invalidate(const std::string& path);
+
+  // spells path the way Resolve reads it: its components joined by single
+  // slashes, without "." or a leading slash, and empty for the mount point.
+  // every spelling of a path gives the same result. a path with ".." comes
+  // back as it is, since Resolve refuses it.
+  static std::string Normalize(const std::string& path);
+
+  // splits path into its parent directory, which is opened or found in the
+  // cache, and its final component. the mount point itself resolves to ".".
+  // returns 0 or -errno.
+  int Resolve(const std::string& path, Location* location);
+private:
+  typedef std::list<std::string> LruList;
+
+  struct Entry {
+    std::shared_ptr<DirHandle> dir;
+    LruList::iterator lru;
+  };
+
+  std::shared_ptr<DirHandle> Find(const std::string& key);
+
+  int OpenDirectory(const std::string& key, std::shared_ptr<DirHandle>* dir);
+
+  void Store(const std::string& key, const std::shared_ptr<DirHandle>& dir);
+
+  std::string mount_point_;
+  std::shared_ptr<DirHandle> root_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  LruList lru_;
+};
+
+}
+
+#endif
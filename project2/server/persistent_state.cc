@@ -1,45 +1,302 @@
 // persistent_state.cc
 // by: allison morris
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <ctime>
+#include <fstream>
+#include <ftw.h>
+#include <functional>
+#include <iostream>
+#include <map>
 #include <set>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "event_log.h"
 #include "persistent_state.h"
 
 using namespace File;
 
-std::mutex PersistentState::mutex_;
+namespace {
+
+// the hidden names LinkAnonymousFile gives uploads before renaming them
+// over their targets.
+const char kLinkPrefix[] = ".filed-";
+
+int RemoveStaleLink(const char* path, const struct stat*, int type, struct FTW* ftw) {
+  if (type == FTW_F && std::strncmp(path + ftw->base, kLinkPrefix,
+      sizeof(kLinkPrefix) - 1) == 0) {
+    unlink(path);
+  }
+  return 0;
+}
+
+}
+
+PersistentState::~PersistentState() {
+  if (store_fd_ >= 0) { close(store_fd_); }
+}
+
+// discards an update that will not be finalized, e.g. after a failed write
+// or because a newer update to the same target has already committed.
+void PersistentState::AbortUpdate(UpdateToken* token) {
+  token->CloseFile();
+  if (!token->IsAnonymous()) { std::remove(token->GetPersistentPath().c_str()); }
+  ReleaseTarget(GetStripe(token->GetTargetPath()), token->GetTargetPath());
+}
+
+// discards a group that did not commit: its staged files are removed and
+// its write targets released.
+void PersistentState::AbortGroup(UpdateGroup* group) {
+  for (const UpdateGroup::Op& op : group->ops_) {
+    if (op.type != kStage) { continue; }
+    if (op.fd >= 0) { io_->Close(op.fd); }
+    std::remove(op.source_path.c_str());
+    ReleaseTarget(GetStripe(op.target_path), op.target_path);
+  }
+  group->ops_.clear();
+  group->state_ = nullptr;
+}
+
+// appends one record to the log. the log is opened with O_APPEND, so a
+// single write places the whole record atomically at the end of the file
+// and concurrent appenders need no lock between them.
+bool PersistentState::AppendRecord(const std::string& record) {
+  const char* data = record.c_str();
+  size_t remaining = record.size();
+  while (remaining > 0) {
+    ssize_t written = write(store_fd_, data, remaining);
+    if (written < 0) {
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    data += written;
+    remaining -= written;
+  }
+  return true;
+}
+
+int PersistentState::ApplyGroupOp(UpdateGroup::Op* op) {
+  switch (op->type) {
+    case kStage: {
+      Stripe& stripe = GetStripe(op->target_path);
+      TargetState& target = stripe.targets[op->target_path];
+      int err = 0;
+      if (target.committed_id > op->id) {
+        // a newer upload of the same target has already won.
+        std::remove(op->source_path.c_str());
+      } else {
+        err = io_->Rename(AT_FDCWD, op->source_path, op->target_dir_fd, op->target_name,
+          op->flags);
+        if (err == 0) {
+          target.committed_id = op->id;
+        } else {
+          std::remove(op->source_path.c_str());
+        }
+      }
+      if (--target.in_flight == 0) { stripe.targets.erase(op->target_path); }
+      return err;
+    }
+    case kRemove: {
+      // like a write, a remove loses to a newer upload that committed first.
+      Stripe& stripe = GetStripe(op->target_path);
+      auto iter = stripe.targets.find(op->target_path);
+      if (iter != stripe.targets.end() && iter->second.committed_id > op->id) { return 0; }
+      int err = io_->Unlink(op->target_dir_fd, op->target_name, 0);
+      if (err == 0) { SupersedeTarget(op->target_path, op->id); }
+      return err;
+    }
+    case kRename: {
+      int err = io_->Rename(op->source_dir_fd, op->source_name, op->target_dir_fd,
+        op->target_name, op->flags);
+      if (err == 0) {
+        SupersedeTarget(op->target_path, op->id);
+        if (op->flags & RENAME_EXCHANGE) { SupersedeTarget(op->source_path, op->id); }
+        // recovery does not replay an exchange, and the log is gone after
+        // the next start, so both directories are synced here.
+        err = SyncDirectory(op->target_dir_fd, ".");
+        if (err == 0 && op->source_dir_fd != op->target_dir_fd) {
+          err = SyncDirectory(op->source_dir_fd, ".");
+        }
+      }
+      return err;
+    }
+    default:
+      assert(0 && "not a group operation.");
+      return -EINVAL;
+  }
+}
+
+int PersistentState::BeginGroup(UpdateGroup* group) {
+  assert(group->state_ == nullptr);
+  group->id_ = next_id_.fetch_add(1);
+  if (!AppendRecord("BEGIN " + std::to_string(group->id_) + "\n")) { return -errno; }
+  group->state_ = this;
+  return 0;
+}
+
+int PersistentState::CommitGroup(UpdateGroup* group) {
+  assert(group->state_ == this && !group->committed_);
+  bool writes = false;
+  std::vector<int> stripes;
+  for (const UpdateGroup::Op& op : group->ops_) {
+    writes = writes || op.type == kStage;
+    stripes.push_back(&GetStripe(op.target_path) - stripes_);
+    if (op.type == kRename) { stripes.push_back(&GetStripe(op.source_path) - stripes_); }
+  }
+
+  // the staged data has to be on disk before the record that makes it
+  // visible after a crash.
+  std::string id = std::to_string(group->id_);
+  int err = writes ? SyncStagedFiles(group) : 0;
+  if (err == 0 && !AppendRecord("COMMIT " + id + "\n")) { err = -errno; }
+  if (err == 0) { err = io_->Sync(store_fd_); }
+  if (err != 0) {
+    AbortGroup(group);
+    return err;
+  }
+  group->committed_ = true;
+
+  // hold every target's stripe, in a fixed order, so that the group is
+  // ordered against single uploads of the same targets as a whole.
+  std::sort(stripes.begin(), stripes.end());
+  stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+  {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (int stripe : stripes) { locks.emplace_back(stripes_[stripe].mutex); }
+    for (UpdateGroup::Op& op : group->ops_) { op.result = ApplyGroupOp(&op); }
+  }
+  AppendRecord("DONE " + id + "\n");
+  return 0;
+}
+
+int PersistentState::CopyUpdate(UpdateToken* token, int source_fd, off_t size,
+    bool* cloned) {
+  int err = io_->Copy(source_fd, token->GetFd(), size, cloned);
+  // a source truncated or extended in place since size was taken gives a
+  // copy that matches neither the old file nor the new one.
+  struct stat st_buffer;
+  if (err == 0) { err = fstat(token->GetFd(), &st_buffer) == 0 ? 0 : -errno; }
+  if (err == 0 && st_buffer.st_size != size) { err = -EAGAIN; }
+  if (err == 0 && token->IsAnonymous()) {
+    err = io_->Sync(token->GetFd());
+    if (err == 0) { token->SetSynced(); }
+  }
+  if (err != 0) { return err; }
+  token->SetWritten(st_buffer.st_size);
+  return 0;
+}
 
 bool PersistentState::CreatePersistentPath(UpdateToken* token) {
-  Lock lock;
-  token->SetPersistentPath(root_dir_ + std::to_string(next_id_));
-  ++next_id_;
+  int id = next_id_.fetch_add(1);
+  token->SetId(id);
+  token->SetPersistentPath(root_dir_ + std::to_string(id));
   return true;
 }
 
 bool PersistentState::CreateUpdateFile(const std::string& full_path, UpdateToken* token) {
-  if (!CreatePersistentPath(token)) {
-    return false;
+  Stripe& stripe = GetStripe(token->GetTargetPath());
+  {
+    // ids are taken under the stripe lock so that, per target, a later
+    // registration always carries a larger id than anything committed.
+    StripeLock lock(stripe);
+    if (!CreatePersistentPath(token)) {
+      return false;
+    }
+    ++stripe.targets[token->GetTargetPath()].in_flight;
   }
 
-  token->GetStream()->open(token->GetPersistentPath(), std::ios::out);
-  if (!token->GetStream()->good()) {
+  // anonymous files need no log record. fall back to journal staging when
+  // the target's file system does not support O_TMPFILE.
+  if (staging_ == kAnonymousStaging && OpenAnonymousFile(token)) {
+    return true;
+  }
+
+  int fd = io_->Open(AT_FDCWD, token->GetPersistentPath(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     std::cerr << "WTF CreateUpdateFile fuqqqqq " << token->GetPersistentPath() << "\n";
+    ReleaseTarget(stripe, token->GetTargetPath());
     return false;
   }
+  token->SetFile(fd, false);
 
-  Lock lock;
-  store_ << "START " << token->GetPersistentPath() << std::endl; // includes flush.
+  if (!AppendRecord("START " + token->GetPersistentPath() + "\n")) {
+    // callers report errno, which cleaning up must not change.
+    int err = errno;
+    AbortUpdate(token);
+    errno = err;
+    return false;
+  }
   return true;
 }
 
 std::istream& operator>>(std::istream& is, PersistentState::Transaction& t) {
+  static const struct {
+    const char* prefix;
+    PersistentState::TransactionType type;
+  } kGroupRecords[] = {
+      { "BEGIN ", PersistentState::kBegin }
+    , { "STAGE ", PersistentState::kStage }
+    , { "REMOVE ", PersistentState::kRemove }
+    , { "RENAME ", PersistentState::kRename }
+    , { "COMMIT ", PersistentState::kCommit }
+    , { "DONE ", PersistentState::kDone }
+  };
+
   std::string line;
   std::getline(is, line);
 
+  // group records: "<prefix><group>", followed by " <id> <target>" for
+  // REMOVE, " <flags> <source> /// <target>" for STAGE and
+  // " <id> <flags> <source> /// <target>" for RENAME. a staged write's id is
+  // the name of its staged file.
+  for (const auto& record : kGroupRecords) {
+    size_t length = std::strlen(record.prefix);
+    if (line.compare(0, length, record.prefix) != 0) { continue; }
+    t.type = record.type;
+    t.persistent_path.clear();
+    t.target_path.clear();
+    char* end_ptr;
+    t.group = std::strtol(line.c_str() + length, &end_ptr, 10);
+    t.good = end_ptr != line.c_str() + length;
+    t.id = -1;
+    t.flags = 0;
+    if ((t.type == PersistentState::kRemove || t.type == PersistentState::kRename) &&
+        t.good) {
+      const char* id = end_ptr;
+      t.id = std::strtol(id, &end_ptr, 10);
+      t.good = end_ptr != id;
+    }
+    if ((t.type == PersistentState::kStage || t.type == PersistentState::kRename) &&
+        t.good) {
+      const char* flags = end_ptr;
+      t.flags = std::strtoul(flags, &end_ptr, 10);
+      t.good = end_ptr != flags;
+    }
+    std::string rest = *end_ptr == ' ' ? std::string(end_ptr + 1) : std::string();
+    if (t.type == PersistentState::kStage || t.type == PersistentState::kRename) {
+      size_t delim = rest.find(" /// ");
+      if (delim == std::string::npos) {
+        t.good = false;
+        return is;
+      }
+      if (t.type == PersistentState::kStage) {
+        t.SetIdFromPath(rest.substr(0, delim));
+      } else {
+        t.persistent_path = rest.substr(0, delim);
+      }
+      t.target_path = rest.substr(delim + 5);
+    } else if (t.type == PersistentState::kRemove) {
+      t.target_path = rest;
+    }
+    return is;
+  }
+
   if (line.find("START ") == 0) { 
     t.type = PersistentState::kStart;
     t.SetIdFromPath(std::move(line.substr(6))); // path after "START "
@@ -69,22 +326,289 @@ std::istream& operator>>(std::istream& is, PersistentState::Transaction& t) {
 }
 
 int PersistentState::FinalizeUpdate(UpdateToken* token) {
-  token->GetStream()->close();
-  struct stat st_buffer;
-  int err = stat(token->GetPersistentPath().c_str(), &st_buffer);
-  if (err != 0) {
-    // std::cerr << "WTF no log for " << token->GetPersistentPath() << " " << -errno << "\n";
+  std::string record;
+  if (token->IsAnonymous()) {
+    int err = token->IsSynced() ? 0 : io_->Sync(token->GetFd());
+    if (err != 0) {
+      AbortUpdate(token);
+      return err;
+    }
+  } else {
+    token->CloseFile();
+    struct stat st_buffer;
+    int err = io_->Stat(AT_FDCWD, token->GetPersistentPath(), &st_buffer);
+    if (err != 0) {
+      // std::cerr << "WTF no log for " << token->GetPersistentPath() << " " << err << "\n";
+      ReleaseTarget(GetStripe(token->GetTargetPath()), token->GetTargetPath());
+      return err;
+    }
+
+    record = "WRITE " + token->GetPersistentPath() + " /// " +
+      token->GetTargetPath() + " /// " + std::to_string(st_buffer.st_size) + "\n";
+  }
+
+  // only updates to the same target are ordered against each other. the
+  // newest update wins: an older one that finishes after it is dropped.
+  Stripe& stripe = GetStripe(token->GetTargetPath());
+  {
+    StripeLock lock(stripe);
+    TargetState& target = stripe.targets[token->GetTargetPath()];
+    if (target.committed_id > token->GetId()) {
+      token->SetSuperseded();
+    } else {
+      int err = 0;
+      if (token->IsAnonymous()) {
+        err = LinkAnonymousFile(*token);
+      } else {
+        err = io_->Rename(AT_FDCWD, token->GetPersistentPath(), token->GetTargetDirFd(),
+          token->GetTargetName(), 0);
+      }
+      if (err == 0) { target.committed_id = token->GetId(); }
+      if (!record.empty()) { AppendRecord(record); }
+      if (--target.in_flight == 0) { stripe.targets.erase(token->GetTargetPath()); }
+      token->CloseFile();
+      return err;
+    }
+  }
+
+  AbortUpdate(token);
+  return 0;
+}
+
+PersistentState::Stripe& PersistentState::GetStripe(const std::string& target_path) {
+  return stripes_[std::hash<std::string>()(target_path) % kStripeCount];
+}
+
+// returns true if a newer update to the token's target has committed while
+// this one was still being written. the caller should stop and abort.
+bool PersistentState::IsSuperseded(const UpdateToken& token) {
+  Stripe& stripe = GetStripe(token.GetTargetPath());
+  StripeLock lock(stripe);
+  auto iter = stripe.targets.find(token.GetTargetPath());
+  return iter != stripe.targets.end() && iter->second.committed_id > token.GetId();
+}
+
+// gives an O_TMPFILE file its target name. linkat will not replace an
+// existing name, so in that case the file is linked under a hidden name
+// beside the target and renamed over it.
+int PersistentState::LinkAnonymousFile(const UpdateToken& token) {
+  std::string fd_path = "/proc/self/fd/" + std::to_string(token.GetFd());
+  int dir_fd = token.GetTargetDirFd();
+  const std::string& name = token.GetTargetName();
+  if (linkat(AT_FDCWD, fd_path.c_str(), dir_fd, name.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+    return 0;
+  }
+  if (errno != EEXIST) { return -errno; }
+
+  size_t base = name.find_last_of('/');
+  std::string temp_name = base == std::string::npos ? std::string() :
+    name.substr(0, base + 1);
+  temp_name += kLinkPrefix + link_tag_ + "-" + std::to_string(token.GetId());
+  if (linkat(AT_FDCWD, fd_path.c_str(), dir_fd, temp_name.c_str(),
+      AT_SYMLINK_FOLLOW) != 0) {
+    return -errno;
+  }
+  int err = io_->Rename(dir_fd, temp_name, dir_fd, name, 0);
+  if (err != 0) { io_->Unlink(dir_fd, temp_name, 0); }
+  return err;
+}
+
+// stages the update in an unnamed file in the target's directory. returns
+// false if the file system cannot create one.
+bool PersistentState::OpenAnonymousFile(UpdateToken* token) {
+  const std::string& name = token->GetTargetName();
+  size_t base = name.find_last_of('/');
+  std::string dir = base == std::string::npos ? "." :
+    (base == 0 ? "/" : name.substr(0, base));
+  int fd = io_->Open(token->GetTargetDirFd(), dir, O_TMPFILE | O_WRONLY, 0644);
+  if (fd < 0) { return false; }
+  token->SetFile(fd, true);
+  return true;
+}
+
+// rolls a committed group forward after a crash. an operation whose effect
+// is already there is skipped: a staged file that is gone has been renamed,
+// and a rename whose source is gone has happened. since a group names each
+// path once, nothing else in the group can have brought them back. an
+// operation is also skipped if the log holds a newer update of its target,
+// which may have landed before the crash and must not be undone. an
+// exchange looks the same done and undone, so it is not replayed; it is
+// applied right after its COMMIT, and a crash in between leaves both files
+// as they were.
+void PersistentState::RecoverGroup(const std::vector<Transaction>& records,
+    const std::map<std::string, int>& newest) {
+  for (const Transaction& record : records) {
+    auto iter = newest.find(record.target_path);
+    bool superseded = iter != newest.end() && iter->second > record.id;
+    struct stat st_buf;
+    if (record.type == kStage) {
+      if (stat(record.persistent_path.c_str(), &st_buf) == 0 && (superseded ||
+          renameat2(AT_FDCWD, record.persistent_path.c_str(), AT_FDCWD,
+            record.target_path.c_str(), record.flags) != 0)) {
+        std::remove(record.persistent_path.c_str());
+      }
+    } else if (record.type == kRename) {
+      if ((record.flags & RENAME_EXCHANGE) == 0 && !superseded &&
+          stat(record.persistent_path.c_str(), &st_buf) == 0) {
+        renameat2(AT_FDCWD, record.persistent_path.c_str(), AT_FDCWD,
+          record.target_path.c_str(), record.flags);
+      }
+    } else if (record.type == kRemove && !superseded) {
+      std::remove(record.target_path.c_str());
+    }
+  }
+}
+
+void PersistentState::RemoveStaleLinks(const std::string& dir) {
+  if (staging_ != kAnonymousStaging) { return; }
+  nftw(dir.c_str(), RemoveStaleLink, 16, FTW_PHYS | FTW_MOUNT);
+}
+
+// drops one in-flight update from the target's state.
+void PersistentState::ReleaseTarget(Stripe& stripe, const std::string& target_path) {
+  StripeLock lock(stripe);
+  auto iter = stripe.targets.find(target_path);
+  if (iter != stripe.targets.end() && --iter->second.in_flight == 0) {
+    stripe.targets.erase(iter);
+  }
+}
+
+int PersistentState::StageRemove(UpdateGroup* group, const std::string& target_path,
+    int dir_fd, const std::string& name) {
+  assert(group->state_ == this && !group->committed_);
+  if (group->Touches(target_path)) { return -EINVAL; }
+  UpdateGroup::Op op;
+  op.type = kRemove;
+  op.target_path = target_path;
+  op.source_dir_fd = AT_FDCWD;
+  op.target_dir_fd = dir_fd;
+  op.target_name = name;
+  op.flags = 0;
+  op.id = next_id_.fetch_add(1);
+  op.fd = -1;
+  op.result = 0;
+  if (!AppendRecord("REMOVE " + std::to_string(group->id_) + " " + std::to_string(op.id) +
+      " " + target_path + "\n")) {
+    return -errno;
+  }
+  group->ops_.push_back(std::move(op));
+  return 0;
+}
+
+int PersistentState::StageRename(UpdateGroup* group, const std::string& from_path,
+    int from_dir_fd, const std::string& from_name, const std::string& to_path,
+    int to_dir_fd, const std::string& to_name, unsigned flags) {
+  assert(group->state_ == this && !group->committed_);
+  if (from_path == to_path || group->Touches(from_path) || group->Touches(to_path)) {
+    return -EINVAL;
+  }
+  UpdateGroup::Op op;
+  op.type = kRename;
+  op.source_path = from_path;
+  op.target_path = to_path;
+  op.source_dir_fd = from_dir_fd;
+  op.source_name = from_name;
+  op.target_dir_fd = to_dir_fd;
+  op.target_name = to_name;
+  op.flags = flags;
+  op.id = next_id_.fetch_add(1);
+  op.fd = -1;
+  op.result = 0;
+  if (!AppendRecord("RENAME " + std::to_string(group->id_) + " " + std::to_string(op.id) +
+      " " + std::to_string(flags) + " " + from_path + " /// " + to_path + "\n")) {
     return -errno;
   }
+  group->ops_.push_back(std::move(op));
+  return 0;
+}
+
+// writes data to a new file in the persistent directory. it replaces the
+// target when the group commits, and is ordered against single uploads of
+// the same target like any other update. the file stays open so that the
+// commit can sync it.
+int PersistentState::StageWrite(UpdateGroup* group, const std::string& target_path,
+    int dir_fd, const std::string& name, const char* data, size_t size, unsigned flags) {
+  assert(group->state_ == this && !group->committed_);
+  if (group->Touches(target_path)) { return -EINVAL; }
+  UpdateGroup::Op op;
+  op.type = kStage;
+  op.target_path = target_path;
+  op.source_dir_fd = AT_FDCWD;
+  op.target_dir_fd = dir_fd;
+  op.target_name = name;
+  op.flags = flags;
+  op.result = 0;
+  Stripe& stripe = GetStripe(target_path);
+  {
+    StripeLock lock(stripe);
+    op.id = next_id_.fetch_add(1);
+    ++stripe.targets[target_path].in_flight;
+  }
+  op.source_path = root_dir_ + std::to_string(op.id);
+
+  op.fd = io_->Open(AT_FDCWD, op.source_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int err = op.fd < 0 ? op.fd : (size == 0 ? 0 : io_->Write(op.fd, data, size, 0, false));
+  if (err == 0 && !AppendRecord("STAGE " + std::to_string(group->id_) + " " +
+      std::to_string(flags) + " " + op.source_path + " /// " + target_path + "\n")) {
+    err = -errno;
+  }
+  if (err != 0) {
+    if (op.fd >= 0) { io_->Close(op.fd); }
+    std::remove(op.source_path.c_str());
+    ReleaseTarget(stripe, target_path);
+    return err;
+  }
+  group->ops_.push_back(std::move(op));
+  return 0;
+}
+
+void PersistentState::SupersedeTarget(const std::string& path, int id) {
+  Stripe& stripe = GetStripe(path);
+  auto iter = stripe.targets.find(path);
+  if (iter != stripe.targets.end() && iter->second.committed_id < id) {
+    iter->second.committed_id = id;
+  }
+}
 
-  Lock lock;
-  err = std::rename(token->GetPersistentPath().c_str(), token->GetTargetPath().c_str());
-  if (err != 0) { err = -errno; }
-  store_ << "WRITE " << token->GetPersistentPath() << " /// " << token->GetTargetPath()
-    << " /// " << st_buffer.st_size << std::endl; // includes flush.
+int PersistentState::SyncStagedFiles(UpdateGroup* group) {
+  int err = 0;
+  for (UpdateGroup::Op& op : group->ops_) {
+    if (op.fd < 0) { continue; }
+    if (err == 0) { err = io_->Sync(op.fd); }
+    io_->Close(op.fd);
+    op.fd = -1;
+  }
+  return err == 0 ? SyncDirectory(AT_FDCWD, root_dir_) : err;
+}
+
+int PersistentState::SyncDirectory(int dir_fd, const std::string& path) {
+  int fd = openat(dir_fd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) { return -errno; }
+  int err = fsync(fd) == 0 ? 0 : -errno;
+  close(fd);
   return err;
 }
 
+PersistentState::UpdateGroup::~UpdateGroup() {
+  if (state_ != nullptr && !committed_) { state_->AbortGroup(this); }
+}
+
+bool PersistentState::UpdateGroup::Touches(const std::string& path) const {
+  for (const Op& op : ops_) {
+    if (op.target_path == path || (op.type == kRename && op.source_path == path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PersistentState::UpdateToken::CloseFile() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
 void PersistentState::Transaction::SetIdFromPath(std::string path) {
   persistent_path = std::move(path);
   size_t base = persistent_path.find_last_of('/');
@@ -99,6 +623,11 @@ void PersistentState::Transaction::SetIdFromPath(std::string path) {
 // closes and re-opens the log for writing. returns true if start-up has
 // completed successfully. 
 bool PersistentState::StartAndRecoverState() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  link_tag_ = std::to_string(getpid()) + "-" +
+    std::to_string(now.tv_sec * 1000000000L + now.tv_nsec);
+
   // check persistent directory exists, or attempt to create it...
   struct stat st_buf;
   int dir_exists = stat(root_dir_.c_str(), &st_buf);
@@ -111,12 +640,14 @@ bool PersistentState::StartAndRecoverState() {
   std::ifstream last_log(store_name_);
   if (last_log.bad()) {
     last_log.close();
-    store_.open(store_name_, std::ios::out | std::ios::trunc);
-    Log()->PersistentStartEvent(false, true, store_.good());
-    return store_.good();
+    store_fd_ = open(store_name_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    Log()->PersistentStartEvent(false, true, store_fd_ >= 0);
+    return store_fd_ >= 0;
   }
 
-  std::set<Transaction> started_transactions;
+  std::vector<Transaction> records;
+  std::set<int> committed_groups;
+  std::set<int> done_groups;
   Transaction transaction;
   bool bad_entry = false;
   while (last_log >> transaction) {
@@ -124,8 +655,42 @@ bool PersistentState::StartAndRecoverState() {
       bad_entry = true;
       continue;
     }
+    if (transaction.type == kCommit) { committed_groups.insert(transaction.group); }
+    if (transaction.type == kDone) { done_groups.insert(transaction.group); }
+    records.push_back(transaction);
+  }
 
-    if (transaction.type == PersistentState::kStart) {
+  // the newest update of each target that took effect, or will once the
+  // log is replayed.
+  std::map<std::string, int> newest;
+  for (const Transaction& transaction : records) {
+    bool group_op = transaction.type == kStage || transaction.type == kRemove ||
+      transaction.type == kRename;
+    if (transaction.type == kWrite ||
+        (group_op && committed_groups.count(transaction.group) != 0)) {
+      auto iter = newest.emplace(transaction.target_path, transaction.id).first;
+      iter->second = std::max(iter->second, transaction.id);
+    }
+  }
+
+  // groups are replayed in the order they committed, among the single-file
+  // updates. a group whose DONE record made it to disk needs nothing.
+  std::set<Transaction> started_transactions;
+  std::map<int, std::vector<Transaction>> groups;
+  for (const Transaction& transaction : records) {
+    if (transaction.type == kBegin) {
+      groups[transaction.group];
+    } else if (transaction.type == kStage || transaction.type == kRemove ||
+        transaction.type == kRename) {
+      groups[transaction.group].push_back(transaction);
+    } else if (transaction.type == kCommit) {
+      if (done_groups.count(transaction.group) == 0) {
+        RecoverGroup(groups[transaction.group], newest);
+      }
+      groups.erase(transaction.group);
+    } else if (transaction.type == kDone) {
+      continue;
+    } else if (transaction.type == PersistentState::kStart) {
       started_transactions.insert(transaction);
     } else {
       auto iter = started_transactions.find(transaction);
@@ -146,12 +711,28 @@ bool PersistentState::StartAndRecoverState() {
     }
   }
 
-  // remove any incomplete transactions that do not have corresponding writes.
+  // remove any incomplete transactions that do not have corresponding writes,
+  // and the staged files of groups that never committed.
   for (const Transaction& trans : started_transactions) {
     std::remove(trans.persistent_path.c_str());
   }
+  for (const auto& group : groups) {
+    for (const Transaction& trans : group.second) {
+      if (trans.type == kStage) { std::remove(trans.persistent_path.c_str()); }
+    }
+  }
   last_log.close();
-  store_.open(store_name_, std::ios::out | std::ios::trunc);
-  Log()->PersistentStartEvent(true, bad_entry, store_.good());
-  return store_.good();
+  store_fd_ = open(store_name_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  Log()->PersistentStartEvent(true, bad_entry, store_fd_ >= 0);
+  return store_fd_ >= 0;
+}
+
+int PersistentState::WriteUpdate(UpdateToken* token, const char* data, size_t size,
+    bool last) {
+  bool sync = last && token->IsAnonymous();
+  int err = io_->Write(token->GetFd(), data, size, token->GetSize(), sync);
+  if (err != 0) { return err; }
+  token->SetWritten(size);
+  if (sync) { token->SetSynced(); }
+  return 0;
 }
@@ -4,20 +4,40 @@
 #ifndef PERSISTENT_STATE_H
 #define PERSISTENT_STATE_H
 
-#include <fstream>
+#include <atomic>
+#include <fcntl.h>
+#include <map>
 #include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+#include "io_backend.h"
 
 namespace File {
 
 class PersistentState {
 public:
-  enum TransactionType { kStart, kWrite };
+  // how uploads are staged before they replace their target. journal
+  // staging writes into the persistent directory and logs the rename;
+  // anonymous staging writes an O_TMPFILE file in the target's directory
+  // and links it into place.
+  enum StagingMode { kJournalStaging, kAnonymousStaging };
+
+  // kStart and kWrite bracket a single-file update. the others make up a
+  // group: kBegin, then kStage (a staged write), kRemove and kRename records,
+  // then kCommit once the group is durable and kDone once it is applied.
+  enum TransactionType {
+    kStart, kWrite, kBegin, kStage, kRemove, kRename, kCommit, kDone
+  };
   
   struct Transaction {
     std::string persistent_path;
     std::string target_path;
     TransactionType type;
     int id;
+    int group;
+    unsigned flags;
     bool good;
     
     bool operator<(const Transaction& t2) const {
@@ -29,51 +49,256 @@ public:
   
   class UpdateToken {
   public:
-    UpdateToken(const std::string& fp) : target_path_(fp) { }
+    UpdateToken(const std::string& fp) : target_path_(fp), target_dir_fd_(AT_FDCWD),
+      fd_(-1), id_(-1), size_(0), anonymous_(false), superseded_(false),
+      synced_(false) { }
+
+    ~UpdateToken() { CloseFile(); }
+
+    void CloseFile();
+
+    int GetFd() const { return fd_; }
+
+    int GetId() const { return id_; }
+
+    off_t GetSize() const { return size_; }
 
     const std::string& GetPersistentPath() const { return persistent_path_; }
 
-    std::ofstream* GetStream() { return &stream_; }
+    // the target as seen by the *at system calls. defaults to the full
+    // target path relative to the working directory.
+    int GetTargetDirFd() const { return target_dir_fd_; }
+
+    const std::string& GetTargetName() const {
+      return target_name_.empty() ? target_path_ : target_name_;
+    }
 
     const std::string& GetTargetPath() const { return target_path_; }
+
+    // true if the update is staged in an O_TMPFILE file with no name yet.
+    bool IsAnonymous() const { return anonymous_; }
+
+    // true if a newer update to the same target committed first, in which
+    // case this update was discarded instead of renamed.
+    bool IsSuperseded() const { return superseded_; }
+
+    // true if the staged data was synced along with the last write.
+    bool IsSynced() const { return synced_; }
+
+    void SetFile(int fd, bool anonymous) {
+      fd_ = fd;
+      anonymous_ = anonymous;
+    }
+
+    void SetId(int id) { id_ = id; }
   
     void SetPersistentPath(std::string str) {
       persistent_path_ = std::move(str);
     }
+
+    void SetSuperseded() { superseded_ = true; }
+
+    void SetSynced() { synced_ = true; }
+
+    void SetTargetLocation(int dir_fd, const std::string& name) {
+      target_dir_fd_ = dir_fd;
+      target_name_ = name;
+    }
+
+    void SetWritten(size_t size) { size_ += size; }
   private:
 
     const std::string& target_path_;
-    std::ofstream stream_;
+    int target_dir_fd_;
+    std::string target_name_;
     std::string persistent_path_;
+    int fd_;
+    int id_;
+    off_t size_;
+    bool anonymous_;
+    bool superseded_;
+    bool synced_;
   };
 
-  PersistentState(const std::string& root, const std::string& store_path) : 
-      root_dir_(root), store_name_(store_path), 
-      store_(), next_id_(0) {
+  // a set of writes, removes and renames that take effect together. they
+  // are staged with StageWrite, StageRemove and StageRename and applied by
+  // CommitGroup. a group destroyed before it commits is discarded.
+  class UpdateGroup {
+  public:
+    UpdateGroup() : state_(nullptr), id_(-1), committed_(false) { }
+
+    ~UpdateGroup();
+
+    int GetId() const { return id_; }
+
+    // the outcome of the index-th staged operation once the group has
+    // committed: 0 or -errno.
+    int GetResult(size_t index) const { return ops_[index].result; }
+
+    size_t GetSize() const { return ops_.size(); }
+  private:
+    friend class PersistentState;
+
+    struct Op {
+      TransactionType type;
+      // the staged file of a write, or the full source path of a rename.
+      std::string source_path;
+      std::string target_path;
+      int source_dir_fd;
+      std::string source_name;
+      int target_dir_fd;
+      std::string target_name;
+      unsigned flags;
+      int id;
+      // the staged file of a write, kept open until the group is synced.
+      int fd;
+      int result;
+    };
+
+    UpdateGroup(const UpdateGroup&);
+    UpdateGroup& operator=(const UpdateGroup&);
+
+    bool Touches(const std::string& path) const;
+
+    PersistentState* state_;
+    int id_;
+    bool committed_;
+    std::vector<Op> ops_;
+  };
+
+  PersistentState(const std::string& root, const std::string& store_path,
+      IoBackend* io, StagingMode staging = kJournalStaging) : 
+      root_dir_(root), store_name_(store_path), io_(io), staging_(staging),
+      store_fd_(-1), next_id_(0) {
     if (root_dir_.back() != '/') {
       root_dir_ += '/';
     }
   }
 
+  ~PersistentState();
+
+  void AbortUpdate(UpdateToken* token);
+
+  // starts an empty group and logs its BEGIN record. returns 0 or -errno.
+  int BeginGroup(UpdateGroup* group);
+
+  // makes every staged operation of the group durable with one synced
+  // COMMIT record, then applies them in order. once COMMIT is on disk the
+  // group is applied in full, by this call or by recovery. an operation
+  // that fails when applied does not undo the others; its error is kept
+  // in the group. returns 0 if the group committed, else -errno and
+  // nothing was applied.
+  int CommitGroup(UpdateGroup* group);
+
+  // fills the staged file, which must still be empty, with the first size
+  // bytes of source_fd. this is the whole of the update's data, so
+  // anonymous staging syncs it straight away. returns 0 or -errno, which is
+  // -EAGAIN if source_fd was not size bytes long by the time it was copied.
+  int CopyUpdate(UpdateToken* token, int source_fd, off_t size, bool* cloned);
+
   bool CreatePersistentPath(UpdateToken* token);
   
   bool CreateUpdateFile(const std::string& full_path, UpdateToken* token);
 
   int FinalizeUpdate(UpdateToken* token);
 
+  bool IsSuperseded(const UpdateToken& token);
+
+  // with anonymous staging, removes the hidden names under dir that a crash
+  // in the middle of linking an upload into place left behind.
+  void RemoveStaleLinks(const std::string& dir);
+
+  // the Stage calls add one operation to an uncommitted group. targets are
+  // given both as the full path, which goes in the log, and as a directory
+  // descriptor and name, which must stay valid until the group commits. a
+  // group may name each path only once, so that recovery can replay it.
+  int StageRemove(UpdateGroup* group, const std::string& target_path,
+    int dir_fd, const std::string& name);
+
+  // flags are renameat2's RENAME_NOREPLACE or RENAME_EXCHANGE.
+  int StageRename(UpdateGroup* group, const std::string& from_path, int from_dir_fd,
+    const std::string& from_name, const std::string& to_path, int to_dir_fd,
+    const std::string& to_name, unsigned flags);
+
+  // flags are given to the rename that applies the write; RENAME_NOREPLACE
+  // makes it fail with -EEXIST if the target exists by then.
+  int StageWrite(UpdateGroup* group, const std::string& target_path, int dir_fd,
+    const std::string& name, const char* data, size_t size, unsigned flags = 0);
+
   bool StartAndRecoverState();
+
+  // appends data to the staged file. last marks the final write of the
+  // update, which lets anonymous staging sync in the same submission.
+  int WriteUpdate(UpdateToken* token, const char* data, size_t size, bool last);
 private:
+  // number of locks that target paths are hashed onto. updates to the same
+  // target always share a stripe, so their renames and log records stay in
+  // order, while updates to different targets rarely contend.
+  static const int kStripeCount = 64;
+
+  // tracks the updates to one target path that have not finished yet. the
+  // entry is dropped once none are in flight.
+  struct TargetState {
+    TargetState() : in_flight(0), committed_id(-1) { }
 
-  class Lock : public std::lock_guard<std::mutex> {
+    int in_flight;
+    int committed_id;
+  };
+
+  struct Stripe {
+    std::mutex mutex;
+    std::unordered_map<std::string, TargetState> targets;
+  };
+
+  // holds the stripe lock for a target path for the lifetime of the object.
+  class StripeLock : public std::lock_guard<std::mutex> {
   public:
-    Lock() : std::lock_guard<std::mutex>(mutex_) { }
+    StripeLock(Stripe& stripe) : std::lock_guard<std::mutex>(stripe.mutex) { }
   };
 
-  static std::mutex mutex_;
+  void AbortGroup(UpdateGroup* group);
+
+  bool AppendRecord(const std::string& record);
+
+  // applies one committed operation of a group. the stripe locks of the
+  // group's write targets must be held.
+  int ApplyGroupOp(UpdateGroup::Op* op);
+
+  Stripe& GetStripe(const std::string& target_path);
+
+  int LinkAnonymousFile(const UpdateToken& token);
+
+  bool OpenAnonymousFile(UpdateToken* token);
+
+  // newest maps each target to the largest id of any update of it in the
+  // log, so that the group does not undo a newer one.
+  void RecoverGroup(const std::vector<Transaction>& records,
+    const std::map<std::string, int>& newest);
+
+  // makes uploads of path that registered before id lose to it. the
+  // path's stripe lock must be held.
+  void SupersedeTarget(const std::string& path, int id);
+
+  void ReleaseTarget(Stripe& stripe, const std::string& target_path);
+
+  // syncs the directory at path, which may be "." for dir_fd itself. dir_fd
+  // may be an O_PATH descriptor.
+  int SyncDirectory(int dir_fd, const std::string& path);
+
+  // syncs the data of each of the group's staged files, then the persistent
+  // directory that names them, and closes the files.
+  int SyncStagedFiles(UpdateGroup* group);
+
   std::string root_dir_;
   std::string store_name_;
-  std::ofstream store_;
-  int next_id_;
+  IoBackend* io_;
+  StagingMode staging_;
+  int store_fd_;
+  // the pid and start time, which keep this run's hidden names apart from
+  // those of earlier runs, whose ids overlap.
+  std::string link_tag_;
+  std::atomic<int> next_id_;
+  Stripe stripes_[kStripeCount];
 };
 
 }
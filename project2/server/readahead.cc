@@ -0,0 +1,48 @@
+// readahead.cc : implements ReadaheadWindow.
+// by: allison morris
+
+#include <algorithm>
+#include <fcntl.h>
+#include <time.h>
+#include "readahead.h"
+
+using namespace File;
+
+ReadaheadWindow::ReadaheadWindow(int fd, off_t size, size_t chunk_size)
+    : fd_(fd), size_(size), chunk_size_(chunk_size), advised_end_(0),
+      window_(2), read_ns_(0), send_ns_(0) {
+  posix_fadvise(fd_, 0, size_, POSIX_FADV_SEQUENTIAL);
+}
+
+void ReadaheadWindow::Advance(off_t offset) {
+  off_t end = std::min<off_t>(size_, offset + (off_t)chunk_size_ * (window_ + 1));
+  if (end <= advised_end_) { return; }
+  off_t start = std::max(advised_end_, offset);
+  posix_fadvise(fd_, start, end - start, POSIX_FADV_WILLNEED);
+  advised_end_ = end;
+}
+
+long ReadaheadWindow::GetTime() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_nsec + ((long)time.tv_sec * 1000000000);
+}
+
+// a read that takes more than a quarter of the time the client needs per
+// chunk means the window did not hide the disk. double it, unless reads are
+// fast on average and this one was a one-off, like a hiccup in the
+// scheduler; doubling for those would only pin memory.
+void ReadaheadWindow::RecordRead(long ns) {
+  read_ns_ = read_ns_ == 0 ? ns : (read_ns_ * 7 + ns) / 8;
+  if (send_ns_ > 0 && ns * 4 > send_ns_ && read_ns_ * 4 > send_ns_) {
+    window_ = std::min(window_ * 2, (int)kMaxWindow);
+  }
+}
+
+// keeps the window within one horizon of the client's consumption rate.
+void ReadaheadWindow::RecordSend(long ns) {
+  send_ns_ = send_ns_ == 0 ? ns : (send_ns_ * 7 + ns) / 8;
+  long horizon_chunks = kHorizonNs / std::max(send_ns_, 1L);
+  int cap = (int)std::max<long>(kMinWindow, std::min<long>(kMaxWindow, horizon_chunks));
+  window_ = std::min(window_, cap);
+}
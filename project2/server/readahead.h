@@ -0,0 +1,49 @@
+// readahead.h : declares ReadaheadWindow, which keeps a streamed download's
+// upcoming chunks on their way in from disk.
+// by: allison morris
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+namespace File {
+
+// tracks how fast the client takes chunks and how long disk reads stall, and
+// advises the kernel to fetch enough chunks ahead of the reader that the
+// next read is served from the page cache. the window grows when reads
+// stall, the latest one and on average, and is capped at about one
+// horizon's worth of the client's rate, so slow clients do not pin memory
+// with data they will not ask for soon.
+class ReadaheadWindow {
+public:
+  static const int kMinWindow = 1;
+  static const int kMaxWindow = 64;
+  static const long kHorizonNs = 500 * 1000 * 1000;
+
+  ReadaheadWindow(int fd, off_t size, size_t chunk_size);
+
+  // advises the kernel about the chunks that follow offset, up to the
+  // current window. call before reading the chunk at offset.
+  void Advance(off_t offset);
+
+  int GetWindow() const { return window_; }
+
+  static long GetTime();
+
+  void RecordRead(long ns);
+
+  void RecordSend(long ns);
+private:
+  int fd_;
+  off_t size_;
+  size_t chunk_size_;
+  off_t advised_end_;
+  int window_;
+  long read_ns_;
+  long send_ns_;
+};
+
+}
+
+#endif
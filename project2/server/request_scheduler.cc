@@ -0,0 +1,124 @@
+// request_scheduler.cc : implements RequestScheduler.
+// by: allison morris
+
+#include <algorithm>
+#include <thread>
+#include "request_scheduler.h"
+
+using namespace File;
+
+const long RequestScheduler::kMetadataCost;
+const int RequestScheduler::kMinBulkSlots;
+
+RequestScheduler::Slot::Slot(RequestScheduler* scheduler, const std::string& peer,
+    RequestClass type, int requests) : scheduler_(scheduler), peer_(peer), type_(type)
+    , start_cost_(kMetadataCost * std::max(requests, 1)), cost_(0) {
+  scheduler_->Acquire(peer_, type_, start_cost_);
+}
+
+RequestScheduler::Slot::~Slot() {
+  scheduler_->Release(peer_, type_, cost_);
+}
+
+void RequestScheduler::Slot::Resume() {
+  scheduler_->Acquire(peer_, type_, start_cost_);
+}
+
+void RequestScheduler::Slot::Yield() {
+  scheduler_->Release(peer_, type_, cost_);
+  cost_ = 0;
+}
+
+RequestScheduler::RequestScheduler(int slots, int bulk_slots)
+    : virtual_time_(), waiting_(), slots_(slots), bulk_slots_(bulk_slots)
+    , running_bulk_(0) {
+  if (slots_ <= 0) { slots_ = std::thread::hardware_concurrency(); }
+  if (bulk_slots_ <= 0) { bulk_slots_ = slots_ - 1; }
+  bulk_slots_ = std::max(bulk_slots_, kMinBulkSlots);
+  // one slot is kept back from bulk requests.
+  slots_ = std::max(slots_, bulk_slots_ + 1);
+  free_slots_ = slots_;
+}
+
+void RequestScheduler::Acquire(const std::string& peer, RequestClass type,
+    long start_cost) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Client& client = clients_[peer];
+  if (client.waiting[type].empty()) {
+    client.finish[type] = std::max(client.finish[type], virtual_time_[type]);
+  }
+
+  Waiter waiter(start_cost);
+  client.waiting[type].push_back(&waiter);
+  ++waiting_[type];
+  Dispatch();
+  waiter.ready.wait(lock, [&waiter]() { return waiter.granted; });
+}
+
+void RequestScheduler::Dispatch() {
+  while (free_slots_ > 0) {
+    RequestClass type;
+    if (waiting_[kMetadata] > 0) {
+      type = kMetadata;
+    } else if (waiting_[kBulk] > 0 && running_bulk_ < bulk_slots_) {
+      type = kBulk;
+    } else {
+      break;
+    }
+
+    auto iter = PickClient(type);
+    Client& client = iter->second;
+    Waiter* waiter = client.waiting[type].front();
+    client.waiting[type].pop_front();
+    --waiting_[type];
+
+    // every request pays the metadata charge when it starts, so a client
+    // cannot take several slots at once before its bulk charges arrive.
+    virtual_time_[type] = client.finish[type];
+    client.finish[type] += waiter->start_cost;
+    ++client.running;
+    --free_slots_;
+    if (type == kBulk) { ++running_bulk_; }
+
+    waiter->granted = true;
+    waiter->ready.notify_one();
+  }
+}
+
+std::map<std::string, RequestScheduler::Client>::iterator RequestScheduler::PickClient(
+    RequestClass type) {
+  auto best = clients_.end();
+  for (auto iter = clients_.begin(); iter != clients_.end(); ++iter) {
+    if (iter->second.waiting[type].empty()) { continue; }
+    if (best == clients_.end() || iter->second.finish[type] < best->second.finish[type]) {
+      best = iter;
+    }
+  }
+  return best;
+}
+
+void RequestScheduler::Release(const std::string& peer, RequestClass type, long cost) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = clients_.find(peer);
+  Client& client = iter->second;
+  client.finish[type] += cost;
+  --client.running;
+  ++free_slots_;
+  if (type == kBulk) { --running_bulk_; }
+
+  Dispatch();
+
+  // clients with nothing queued or running whose debt the virtual time has
+  // caught up with are forgotten; they would restart at the virtual time
+  // anyway.
+  for (iter = clients_.begin(); iter != clients_.end();) {
+    const Client& idle = iter->second;
+    if (idle.running == 0 && idle.waiting[kMetadata].empty() &&
+        idle.waiting[kBulk].empty() && idle.finish[kMetadata] <= virtual_time_[kMetadata] &&
+        idle.finish[kBulk] <= virtual_time_[kBulk]) {
+      iter = clients_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
@@ -0,0 +1,128 @@
+// request_scheduler.h : declares RequestScheduler, which decides which
+// client's request runs next.
+// by: allison morris
+
+#ifndef REQUEST_SCHEDULER_H
+#define REQUEST_SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace File {
+
+// limits how many requests do file service work at once and hands the free
+// slots out fairly between clients. requests are either metadata (stat,
+// create, remove, list) or bulk data (upload, download), and each client,
+// as named by its grpc peer, has its own queue per class. waiting metadata
+// always goes first, and bulk requests may not take the last slot, so a
+// client streaming large files cannot hold up anyone's GetFileInfo. a slot
+// is meant to cover file i/o only: a request that waits on the network,
+// like a stream to a slow client, gives its slot up meanwhile with Pause.
+//
+// within a class, slots go to the waiting client that has been served the
+// least: each client carries a virtual finish time that grows by the bytes
+// its requests moved (or a fixed charge for metadata) and the smallest one
+// runs next. this is start-time fair queuing; it needs no cost estimate up
+// front, which matters because a download's size is only known once it has
+// started. a client that was idle restarts at the current virtual time, so
+// it cannot bank credit.
+class RequestScheduler {
+public:
+  enum RequestClass { kMetadata, kBulk, kClassCount };
+
+  // the charge for one metadata request, in bytes.
+  static const long kMetadataCost = 4096;
+  // the fewest bulk requests that may run at once, so that one stuck bulk
+  // request cannot stall the rest.
+  static const int kMinBulkSlots = 2;
+
+  // holds a slot for the lifetime of a request.
+  class Slot {
+  public:
+    // gives a slot up for its own lifetime and queues for it again after.
+    class Pause {
+    public:
+      explicit Pause(Slot* slot) : slot_(slot) { slot_->Yield(); }
+
+      ~Pause() { slot_->Resume(); }
+    private:
+      Pause(const Pause&);
+      Pause& operator=(const Pause&);
+
+      Slot* slot_;
+    };
+
+    // requests is how many requests the slot stands for, like the
+    // operations of a batch. each pays the start charge.
+    Slot(RequestScheduler* scheduler, const std::string& peer, RequestClass type,
+      int requests = 1);
+
+    ~Slot();
+
+    // records bytes moved by the request, charged to its client on release.
+    void Charge(long bytes) { cost_ += bytes; }
+  private:
+    Slot(const Slot&);
+    Slot& operator=(const Slot&);
+
+    // releases the slot with the charges so far; Resume waits for it again,
+    // paying the start charge again like a new request.
+    void Yield();
+
+    void Resume();
+
+    RequestScheduler* scheduler_;
+    std::string peer_;
+    RequestClass type_;
+    long start_cost_;
+    long cost_;
+  };
+
+  // slots of zero picks one per hardware thread, and bulk_slots of zero
+  // lets bulk requests use all but one slot. bulk requests get at least
+  // kMinBulkSlots, and there is always one more slot than that.
+  explicit RequestScheduler(int slots = 0, int bulk_slots = 0);
+private:
+  struct Waiter {
+    std::condition_variable ready;
+    long start_cost;
+    bool granted;
+
+    explicit Waiter(long cost) : start_cost(cost), granted(false) { }
+  };
+
+  struct Client {
+    std::deque<Waiter*> waiting[kClassCount];
+    long finish[kClassCount];
+    int running;
+
+    Client() : finish(), running(0) { }
+  };
+
+  void Acquire(const std::string& peer, RequestClass type, long start_cost);
+
+  // grants free slots to waiting requests. mutex_ must be held.
+  void Dispatch();
+
+  // returns the waiting client with the smallest finish time in type, or
+  // clients_.end().
+  std::map<std::string, Client>::iterator PickClient(RequestClass type);
+
+  void Release(const std::string& peer, RequestClass type, long cost);
+
+  std::mutex mutex_;
+  std::map<std::string, Client> clients_;
+  long virtual_time_[kClassCount];
+  int waiting_[kClassCount];
+  int slots_;
+  int bulk_slots_;
+  int free_slots_;
+  int running_bulk_;
+};
+
+}
+
+#endif
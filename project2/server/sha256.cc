@@ -0,0 +1,203 @@
+// sha256.cc : implements Sha256.
+// by: allison morris
+
+// the sha extensions version follows the round structure from intel's
+// white paper: the state is kept as the ABEF and CDGH halves that
+// sha256rnds2 works on, and the message schedule for round group g+3 is
+// begun by sha256msg1 in group g and finished by sha256msg2 in group g+2.
+
+#include <algorithm>
+#include <cstring>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+using namespace File;
+
+const size_t Sha256::kDigestSize;
+
+namespace {
+
+const uint32_t kRoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t Rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void CompressPortable(uint32_t* state, const uint8_t* blocks, size_t count) {
+  for (; count > 0; --count, blocks += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (uint32_t)blocks[i * 4] << 24 | (uint32_t)blocks[i * 4 + 1] << 16 |
+        (uint32_t)blocks[i * 4 + 2] << 8 | blocks[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t s1 = Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25);
+      uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + kRoundConstants[i] + w[i];
+      uint32_t s0 = Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22);
+      uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef SHA256_X86
+__attribute__((target("sha,sse4.1")))
+void CompressShaNi(uint32_t* state, const uint8_t* blocks, size_t count) {
+  const __m128i kByteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i dcba = _mm_loadu_si128((const __m128i*)&state[0]);
+  __m128i hgfe = _mm_loadu_si128((const __m128i*)&state[4]);
+  __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+  __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+  __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+  for (; count > 0; --count, blocks += 64) {
+    __m128i abef_start = abef;
+    __m128i cdgh_start = cdgh;
+    __m128i w[4];
+    for (int i = 0; i < 4; ++i) {
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + i * 16)), kByteSwap);
+    }
+
+    for (int g = 0; g < 16; ++g) {
+      __m128i& current = w[g & 3];
+      __m128i message = _mm_add_epi32(current,
+        _mm_loadu_si128((const __m128i*)&kRoundConstants[g * 4]));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+      if (g >= 3 && g <= 14) {
+        __m128i& next = w[(g + 1) & 3];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(current, w[(g + 3) & 3], 4));
+        next = _mm_sha256msg2_epu32(next, current);
+      }
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0e));
+      if (g >= 1 && g <= 12) {
+        __m128i& previous = w[(g + 3) & 3];
+        previous = _mm_sha256msg1_epu32(previous, current);
+      }
+    }
+
+    abef = _mm_add_epi32(abef, abef_start);
+    cdgh = _mm_add_epi32(cdgh, cdgh_start);
+  }
+
+  __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+  __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+  _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+bool HasShaExtensions() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) { return false; }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) { return false; }
+  return (ebx & bit_SHA) != 0;
+}
+#endif
+
+}
+
+Sha256::Sha256() : buffered_(0), length_(0), compress_(GetCompress()) {
+  static const uint32_t kInitialState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  std::memcpy(state_, kInitialState, sizeof(state_));
+}
+
+std::string Sha256::Final() {
+  uint64_t bits = length_ * 8;
+  uint8_t padding[72] = { 0x80 };
+  size_t pad = (buffered_ < 56 ? 56 : 120) - buffered_;
+  for (int i = 0; i < 8; ++i) { padding[pad + i] = (uint8_t)(bits >> (56 - i * 8)); }
+  Update(padding, pad + 8);
+
+  std::string digest(kDigestSize, '\0');
+  for (int i = 0; i < 8; ++i) {
+    digest[i * 4] = (char)(state_[i] >> 24);
+    digest[i * 4 + 1] = (char)(state_[i] >> 16);
+    digest[i * 4 + 2] = (char)(state_[i] >> 8);
+    digest[i * 4 + 3] = (char)state_[i];
+  }
+  return digest;
+}
+
+Sha256::CompressFunction Sha256::GetCompress() {
+#ifdef SHA256_X86
+  static const CompressFunction compress = HasShaExtensions() ? CompressShaNi : CompressPortable;
+  return compress;
+#else
+  return CompressPortable;
+#endif
+}
+
+const char* Sha256::GetImplementation() {
+  return GetCompress() == CompressPortable ? "portable" : "sha-ni";
+}
+
+std::string Sha256::ToHex(const std::string& digest) {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(digest.size() * 2);
+  for (unsigned char c : digest) {
+    hex += kDigits[c >> 4];
+    hex += kDigits[c & 15];
+  }
+  return hex;
+}
+
+void Sha256::Update(const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  length_ += size;
+  if (buffered_ > 0) {
+    size_t take = std::min(size, sizeof(buffer_) - buffered_);
+    std::memcpy(buffer_ + buffered_, bytes, take);
+    buffered_ += take;
+    bytes += take;
+    size -= take;
+    if (buffered_ < sizeof(buffer_)) { return; }
+    compress_(state_, buffer_, 1);
+    buffered_ = 0;
+  }
+  if (size >= 64) {
+    compress_(state_, bytes, size / 64);
+    bytes += size / 64 * 64;
+    size %= 64;
+  }
+  std::memcpy(buffer_, bytes, size);
+  buffered_ = size;
+}
@@ -0,0 +1,48 @@
+// sha256.h : declares Sha256, an incremental sha-256 hash.
+// by: allison morris
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace File {
+
+// hashes data fed to it in pieces of any size. blocks are compressed with
+// the x86 sha extensions when the cpu has them, which is several times
+// faster than the portable code used otherwise; the choice is made once,
+// the first time a hash is started.
+class Sha256 {
+public:
+  static const size_t kDigestSize = 32;
+
+  Sha256();
+
+  // returns the 32-byte digest of everything passed to Update. the hash
+  // may not be updated afterwards.
+  std::string Final();
+
+  // "sha-ni" or "portable".
+  static const char* GetImplementation();
+
+  // returns digest as lowercase hex.
+  static std::string ToHex(const std::string& digest);
+
+  void Update(const void* data, size_t size);
+private:
+  typedef void (*CompressFunction)(uint32_t* state, const uint8_t* blocks, size_t count);
+
+  static CompressFunction GetCompress();
+
+  uint32_t state_[8];
+  uint8_t buffer_[64];
+  size_t buffered_;
+  uint64_t length_;
+  CompressFunction compress_;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+// version_table.cc : implements VersionTable.
+// by: allison morris
+
+#include <cerrno>
+#include <ctime>
+#include "version_table.h"
+
+using namespace File;
+
+const size_t VersionTable::kCapacity;
+const off_t VersionTable::kMaxBytes;
+const long VersionTable::kLeaseMs;
+
+namespace {
+
+bool SameFile(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+    a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+}
+
+// ids start from the wall clock, so that an id handed out before a restart
+// is not mistaken for one handed out after it.
+VersionTable::VersionTable() : bytes_(0), next_id_((uint64_t)time(nullptr) << 20) { }
+
+void VersionTable::Expire(long now) {
+  while (!lru_.empty()) {
+    auto iter = entries_.find(lru_.back());
+    if (entries_.size() <= kCapacity && bytes_ <= kMaxBytes && iter->second.expiry > now) {
+      break;
+    }
+    auto latest = latest_.find(iter->second.path);
+    if (latest != latest_.end() && latest->second == iter->first) { latest_.erase(latest); }
+    bytes_ -= iter->second.st.st_size;
+    entries_.erase(iter);
+    lru_.pop_back();
+  }
+}
+
+int VersionTable::Find(const std::string& path, uint64_t id,
+    std::shared_ptr<FileHandle>* file, struct stat* st) {
+  long now = GetTimeMs();
+  std::lock_guard<std::mutex> lock(mutex_);
+  Expire(now);
+  auto iter = entries_.find(id);
+  if (iter == entries_.end() || iter->second.path != path) { return -ESTALE; }
+  Entry& entry = iter->second;
+  entry.expiry = now + kLeaseMs;
+  lru_.splice(lru_.begin(), lru_, entry.lru);
+  *file = entry.file;
+  *st = entry.st;
+  return 0;
+}
+
+long VersionTable::GetTimeMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+uint64_t VersionTable::Pin(const std::string& path, const std::shared_ptr<FileHandle>& file,
+    const struct stat& st) {
+  if (!S_ISREG(st.st_mode) || st.st_size > kMaxBytes) { return 0; }
+  long now = GetTimeMs();
+  std::lock_guard<std::mutex> lock(mutex_);
+  Expire(now);
+  auto latest = latest_.find(path);
+  if (latest != latest_.end()) {
+    Entry& entry = entries_[latest->second];
+    if (SameFile(entry.st, st)) {
+      entry.expiry = now + kLeaseMs;
+      lru_.splice(lru_.begin(), lru_, entry.lru);
+      return latest->second;
+    }
+  }
+
+  uint64_t id = next_id_++;
+  lru_.push_front(id);
+  Entry& entry = entries_[id];
+  entry.path = path;
+  entry.file = file;
+  entry.st = st;
+  entry.expiry = now + kLeaseMs;
+  entry.lru = lru_.begin();
+  bytes_ += st.st_size;
+  latest_[path] = id;
+  Expire(now);
+  return id;
+}
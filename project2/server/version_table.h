@@ -0,0 +1,79 @@
+// version_table.h : declares VersionTable, which keeps the files that
+// downloads were served from readable by later ranged reads.
+// by: allison morris
+
+#ifndef VERSION_TABLE_H
+#define VERSION_TABLE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include "file_cache.h"
+
+namespace File {
+
+// uploads replace a file by renaming a new inode over it, so an open
+// descriptor keeps reading the version it was opened on. a download pins
+// its descriptor here under a version id that is sent to the client; a
+// ranged read naming that id reads the same bytes even if the path has
+// been replaced or removed since, so a broken multi-gigabyte download can
+// resume where it stopped instead of starting over.
+//
+// a version stays pinned for a lease renewed by every read of it. each one
+// holds a descriptor, and a replaced file's disk space, until it goes, so
+// at most kCapacity versions of at most kMaxBytes in all are pinned, the
+// least recently read going first. that keeps the table well inside the
+// descriptor limit, which filed raises at startup. a version shares its
+// descriptor with the file cache while the file is cached there. pinning
+// the same file at the same path again returns the same id.
+class VersionTable {
+public:
+  static const size_t kCapacity = 256;
+  static const off_t kMaxBytes = 16L << 30;
+  static const long kLeaseMs = 5 * 60 * 1000;
+
+  VersionTable();
+
+  // finds version id of path. returns 0, or -ESTALE if it was never pinned
+  // under path or has been let go.
+  int Find(const std::string& path, uint64_t id, std::shared_ptr<FileHandle>* file,
+    struct stat* st);
+
+  // pins file, which was opened at path with attributes st, and returns its
+  // version id. only regular files of at most kMaxBytes are pinned; others
+  // get version 0.
+  uint64_t Pin(const std::string& path, const std::shared_ptr<FileHandle>& file,
+    const struct stat& st);
+private:
+  typedef std::list<uint64_t> LruList;
+
+  struct Entry {
+    std::string path;
+    std::shared_ptr<FileHandle> file;
+    struct stat st;
+    long expiry;
+    LruList::iterator lru;
+  };
+
+  // drops versions past their lease or over capacity. mutex_ must be held.
+  void Expire(long now);
+
+  static long GetTimeMs();
+
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> entries_;
+  // the newest version pinned for each path.
+  std::unordered_map<std::string, uint64_t> latest_;
+  LruList lru_;
+  // the total size of the pinned versions.
+  off_t bytes_;
+  uint64_t next_id_;
+};
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# runs each workload through the FUSE mount and directly over rpc against
+# the same files, and lines the average, max and min latencies (ns) up side
+# by side. the difference is the cost of the FUSE client.
+
+EXE=./tester
+RPC_EXE=./rpc_tester
+ROOT=../clientbazil/root
+SERVER=localhost:61512
+THREADS=8
+CHANNELS=4
+
+# prints "avg max min" from a tester report.
+times() {
+  awk '/Avg time/ { avg = $3 } /Max time/ { max = $3 } /Min time/ { min = $3 }
+    END { print avg, max, min }'
+}
+
+printf "%-6s %-3s %12s %12s %12s %12s %12s %12s\n" size op fuse-avg rpc-avg fuse-max \
+  rpc-max fuse-min rpc-min
+for i in 2k 4k 16k 256k 4m 16m 64m
+do
+  for op in a r w
+  do
+    if [ $op = a ]; then
+      fuse=$($EXE MultiAccess $ROOT/blob-$i $THREADS | times)
+    else
+      fuse=$($EXE MultiReadWrite $ROOT/blob-$i $op $THREADS | times)
+    fi
+    rpc=$($RPC_EXE RpcMulti $SERVER /blob-$i $op $THREADS $CHANNELS | times)
+    set -- $fuse $rpc
+    printf "%-6s %-3s %12s %12s %12s %12s %12s %12s\n" $i $op $1 $4 $2 $5 $3 $6
+  done
+done
@@ -0,0 +1,231 @@
+// compare_results.cc : compares two benchmark result files written with --csv.
+// by: allison morris
+
+// for each benchmark in both files the two latency distributions are
+// compared with a mann-whitney u test, which makes no assumption about
+// their shape; latencies are rarely normal. a benchmark has regressed when
+// the candidate is slower with a p-value below alpha and its median moved
+// by more than threshold percent, so that neither noise nor a real but
+// negligible shift fails the comparison. exits with 1 if anything
+// regressed, so it can gate a change. several result files catted together
+// make one result file.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Benchmark {
+  long count;
+  long errors;
+  std::vector<std::pair<long, long>> buckets;
+
+  Benchmark() : count(0), errors(0) { }
+};
+
+struct ResultFile {
+  std::map<std::string, std::string> environment;
+  // kept in file order, for printing.
+  std::vector<std::string> names;
+  std::map<std::string, Benchmark> benchmarks;
+};
+
+// splits a csv line into fields, undoing quoting.
+std::vector<std::string> SplitCsv(const std::string& line) {
+  std::vector<std::string> fields(1);
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quoted) {
+      if (c != '"') {
+        fields.back() += c;
+      } else if (i + 1 < line.size() && line[i + 1] == '"') {
+        fields.back() += c;
+        ++i;
+      } else {
+        quoted = false;
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields.push_back(std::string());
+    } else {
+      fields.back() += c;
+    }
+  }
+  return fields;
+}
+
+bool Load(const std::string& path, ResultFile* file) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "could not read " << path << "\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) { continue; }
+    if (line.compare(0, 2, "# ") == 0) {
+      size_t equals = line.find('=');
+      if (equals != std::string::npos) {
+        file->environment[line.substr(2, equals - 2)] = line.substr(equals + 1);
+      }
+      continue;
+    }
+    // result files may be concatenated, headers and all.
+    if (line.compare(0, 10, "benchmark,") == 0) { continue; }
+    // benchmark,count,errors,mean,min,p50,p90,p99,p99.9,max,metrics,distribution
+    std::vector<std::string> fields = SplitCsv(line);
+    if (fields.size() != 12) {
+      std::cerr << path << ": bad line: " << line << "\n";
+      return false;
+    }
+    if (file->benchmarks.count(fields[0]) == 0) { file->names.push_back(fields[0]); }
+    Benchmark& benchmark = file->benchmarks[fields[0]];
+    // a benchmark run more than once in a file pools its samples.
+    benchmark.count += strtol(fields[1].c_str(), nullptr, 10);
+    benchmark.errors += strtol(fields[2].c_str(), nullptr, 10);
+    std::istringstream distribution(fields[11]);
+    std::string bucket;
+    while (distribution >> bucket) {
+      size_t colon = bucket.find(':');
+      if (colon == std::string::npos) { continue; }
+      benchmark.buckets.push_back(std::make_pair(strtol(bucket.c_str(), nullptr, 10),
+        strtol(bucket.c_str() + colon + 1, nullptr, 10)));
+    }
+  }
+  for (auto& pair : file->benchmarks) {
+    std::sort(pair.second.buckets.begin(), pair.second.buckets.end());
+  }
+  return true;
+}
+
+long GetMedian(const Benchmark& benchmark) {
+  long seen = 0;
+  for (const auto& bucket : benchmark.buckets) {
+    seen += bucket.second;
+    if (seen * 2 >= benchmark.count) { return bucket.first; }
+  }
+  return 0;
+}
+
+// returns the two-sided p-value of a mann-whitney u test between base and
+// candidate, and sets z, which is positive when candidate tends larger.
+// equal values, which bucketing makes common, get their average rank.
+double MannWhitney(const Benchmark& base, const Benchmark& candidate, double* z) {
+  double n1 = base.count;
+  double n2 = candidate.count;
+  double rank_sum = 0;
+  double ties = 0;
+  double rank = 1;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < base.buckets.size() || j < candidate.buckets.size()) {
+    long value;
+    if (j == candidate.buckets.size() ||
+        (i < base.buckets.size() && base.buckets[i].first <= candidate.buckets[j].first)) {
+      value = base.buckets[i].first;
+    } else {
+      value = candidate.buckets[j].first;
+    }
+    double in_base = 0;
+    double in_candidate = 0;
+    for (; i < base.buckets.size() && base.buckets[i].first == value; ++i) {
+      in_base += base.buckets[i].second;
+    }
+    for (; j < candidate.buckets.size() && candidate.buckets[j].first == value; ++j) {
+      in_candidate += candidate.buckets[j].second;
+    }
+    double tied = in_base + in_candidate;
+    rank_sum += in_candidate * (rank + (tied - 1) / 2);
+    ties += tied * tied * tied - tied;
+    rank += tied;
+  }
+
+  double u = rank_sum - n2 * (n2 + 1) / 2;
+  double n = n1 + n2;
+  double variance = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+  if (variance <= 0) {
+    *z = 0;
+    return 1;
+  }
+  *z = (u - n1 * n2 / 2) / std::sqrt(variance);
+  return std::erfc(std::fabs(*z) / std::sqrt(2.0));
+}
+
+int main(int argc, const char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: compare_results baseline.csv candidate.csv [alpha] [threshold %]\n";
+    return 2;
+  }
+  double alpha = argc > 3 ? strtod(argv[3], nullptr) : 0.01;
+  double threshold = argc > 4 ? strtod(argv[4], nullptr) : 5;
+  ResultFile base;
+  ResultFile candidate;
+  if (!Load(argv[1], &base) || !Load(argv[2], &candidate)) { return 2; }
+
+  // results from different machines or builds are not comparable.
+  for (const char* key : { "host", "cpu", "cpus", "kernel", "compiler", "optimized" }) {
+    if (base.environment[key] != candidate.environment[key]) {
+      std::cout << "warning: " << key << " differs: " << base.environment[key] << " vs "
+        << candidate.environment[key] << "\n";
+    }
+  }
+
+  int regressions = 0;
+  std::cout << std::left << std::setw(50) << "benchmark" << std::right << std::setw(12)
+    << "base p50" << std::setw(12) << "new p50" << std::setw(9) << "change"
+    << std::setw(10) << "p-value" << "  verdict\n";
+  for (const std::string& name : base.names) {
+    auto found = candidate.benchmarks.find(name);
+    std::cout << std::left << std::setw(50) << name.substr(0, 49) << std::right;
+    if (found == candidate.benchmarks.end()) {
+      std::cout << "  missing from candidate\n";
+      continue;
+    }
+    const Benchmark& before = base.benchmarks[name];
+    const Benchmark& after = found->second;
+    long base_median = GetMedian(before);
+    long new_median = GetMedian(after);
+    double change = base_median == 0 ? 0 : 100.0 * (new_median - base_median) / base_median;
+    std::cout << std::setw(12) << base_median << std::setw(12) << new_median << std::setw(8)
+      << std::fixed << std::setprecision(1) << change << "%";
+
+    const char* verdict;
+    if (before.count < 2 || after.count < 2) {
+      std::cout << std::setw(10) << "-";
+      verdict = "too few samples";
+    } else {
+      double z;
+      double p = MannWhitney(before, after, &z);
+      std::cout << std::setw(10) << std::setprecision(4) << p;
+      if (p >= alpha || std::fabs(change) <= threshold) {
+        verdict = "same";
+      } else if (z > 0) {
+        verdict = "REGRESSED";
+        ++regressions;
+      } else {
+        verdict = "improved";
+      }
+    }
+    std::cout << "  " << verdict;
+    if (after.errors > before.errors) {
+      std::cout << " (errors " << before.errors << " -> " << after.errors << ")";
+    }
+    std::cout << "\n";
+  }
+  for (const std::string& name : candidate.names) {
+    if (base.benchmarks.find(name) == base.benchmarks.end()) {
+      std::cout << std::left << std::setw(50) << name.substr(0, 49) << "  new in candidate\n";
+    }
+  }
+  std::cout << regressions << " regression" << (regressions == 1 ? "" : "s") << "\n";
+  return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+// histogram.h
+// by: allison morris
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <climits>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// a high dynamic range histogram of nanosecond latencies. values below
+// kSubBuckets are counted exactly; above that each power of two is split
+// into kSubBuckets / 2 buckets, so every value is kept to within 0.1%
+// whether it is a microsecond or ten minutes. values past kMaxValue, about
+// eighteen minutes, are counted as kMaxValue. recording is a shift and an
+// increment, and histograms from several threads can be added together.
+class Histogram {
+public:
+  static const long kSubBuckets = 2048;
+  static const long kMaxValue = (1L << 40) - 1;
+
+  Histogram() : counts_(kSubBuckets + 29 * (kSubBuckets / 2)), count_(0), sum_(0),
+    min_(LONG_MAX), max_(0) { }
+
+  void Add(const Histogram& other) {
+    for (size_t i = 0; i < counts_.size(); ++i) { counts_[i] += other.counts_[i]; }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = other.min_ < min_ ? other.min_ : min_;
+    max_ = other.max_ > max_ ? other.max_ : max_;
+  }
+
+  // fills buckets with the largest value and the count of every bucket that
+  // was recorded into, smallest first.
+  void GetBuckets(std::vector<std::pair<long, long>>* buckets) const {
+    buckets->clear();
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      if (counts_[i] == 0) { continue; }
+      long value = GetValue(i);
+      buckets->push_back(std::make_pair(value < max_ ? value : max_, counts_[i]));
+    }
+  }
+
+  long GetCount() const { return count_; }
+
+  long GetMax() const { return max_; }
+
+  long GetMean() const { return count_ == 0 ? 0 : (long)(sum_ / count_); }
+
+  long GetMin() const { return count_ == 0 ? 0 : min_; }
+
+  // returns the value that percentile percent of the recorded values are at
+  // or below, to the histogram's precision.
+  long GetPercentile(double percentile) const {
+    if (count_ == 0) { return 0; }
+    long target = (long)std::ceil(percentile / 100 * count_);
+    target = target < 1 ? 1 : target;
+    long seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= target) {
+        long value = GetValue(i);
+        return value < max_ ? value : max_;
+      }
+    }
+    return max_;
+  }
+
+  void Record(long value) {
+    value = value < 0 ? 0 : (value > kMaxValue ? kMaxValue : value);
+    ++counts_[GetIndex(value)];
+    ++count_;
+    sum_ += value;
+    min_ = value < min_ ? value : min_;
+    max_ = value > max_ ? value : max_;
+  }
+private:
+  static size_t GetIndex(long value) {
+    if (value < kSubBuckets) { return value; }
+    int shift = 63 - __builtin_clzl(value) - 10;
+    return kSubBuckets + (shift - 1) * (kSubBuckets / 2) + ((value >> shift) - kSubBuckets / 2);
+  }
+
+  // the largest value counted in bucket index.
+  static long GetValue(size_t index) {
+    if (index < (size_t)kSubBuckets) { return index; }
+    long bucket = index - kSubBuckets;
+    int shift = bucket / (kSubBuckets / 2) + 1;
+    long sub_bucket = bucket % (kSubBuckets / 2) + kSubBuckets / 2;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+  std::vector<long> counts_;
+  long count_;
+  double sum_;
+  long min_;
+  long max_;
+};
+
+#endif
@@ -0,0 +1,193 @@
+// metadata_test.h
+// by: allison morris
+
+// an mdtest-style metadata benchmark. a tree of directories, depth levels
+// deep with branch subdirectories each, is built under root; then every
+// thread creates, stats and removes items directories in each tree
+// directory, and does the same with items files, listing every directory
+// while the files exist. each phase starts on all threads at once and is
+// reported as operations per second. with unique trees every thread works
+// in a tree of its own; with a shared tree all threads create their items
+// side by side in the same directories, which is where the server's
+// per-directory contention shows.
+
+#include <cerrno>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "histogram.h"
+
+class MetadataTest {
+public:
+  enum Phase {
+    kDirCreate, kDirStat, kDirRemove, kFileCreate, kFileStat, kReaddir, kFileRemove,
+    kPhaseCount
+  };
+
+  struct Config {
+    std::string root;
+    int threads;
+    int depth;
+    int branch;
+    int items;
+    bool shared;
+  };
+
+  struct PhaseResult {
+    long ops;
+    long errors;
+    long time;
+    Histogram latency;
+
+    PhaseResult() : ops(0), errors(0), time(0) { }
+  };
+
+  static const char* GetPhaseName(Phase phase) {
+    static const char* kNames[] = {
+      "dir create", "dir stat", "dir remove", "file create", "file stat", "readdir",
+      "file remove"
+    };
+    return kNames[phase];
+  }
+
+  explicit MetadataTest(const Config& config) : config_(config), waiting_(0),
+    generation_(0) { }
+
+  // runs every phase. returns false if the tree could not be built.
+  bool Run(PhaseResult results[kPhaseCount]) {
+    int trees = config_.shared ? 1 : config_.threads;
+    for (int t = 0; t < trees; ++t) {
+      std::vector<std::string> dirs;
+      if (!BuildTree(GetTreeRoot(t), 0, &dirs)) { return false; }
+      tree_dirs_.push_back(dirs);
+    }
+
+    std::vector<PhaseResult> partial(config_.threads * kPhaseCount);
+    std::vector<long> starts(kPhaseCount);
+    std::vector<long> ends(kPhaseCount);
+    std::vector<std::thread> threads;
+    for (int id = 0; id < config_.threads; ++id) {
+      threads.push_back(std::thread([&, id]() {
+        for (int p = 0; p < kPhaseCount; ++p) {
+          Wait(&starts[p]);
+          partial[id * kPhaseCount + p] = RunPhase((Phase)p, id);
+          Wait(&ends[p]);
+        }
+      }));
+    }
+    for (auto& thread : threads) { thread.join(); }
+
+    for (int p = 0; p < kPhaseCount; ++p) {
+      results[p].ops = 0;
+      results[p].errors = 0;
+      results[p].time = ends[p] - starts[p];
+      for (int id = 0; id < config_.threads; ++id) {
+        results[p].ops += partial[id * kPhaseCount + p].ops;
+        results[p].errors += partial[id * kPhaseCount + p].errors;
+        results[p].latency.Add(partial[id * kPhaseCount + p].latency);
+      }
+    }
+
+    for (int t = 0; t < trees; ++t) {
+      for (auto dir = tree_dirs_[t].rbegin(); dir != tree_dirs_[t].rend(); ++dir) {
+        rmdir(dir->c_str());
+      }
+    }
+    return true;
+  }
+private:
+  // creates the directories below path, depth levels down, and appends
+  // every directory of the tree to dirs, parents first.
+  bool BuildTree(const std::string& path, int level, std::vector<std::string>* dirs) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) { return false; }
+    dirs->push_back(path);
+    if (level == config_.depth) { return true; }
+    for (int b = 0; b < config_.branch; ++b) {
+      if (!BuildTree(path + "/d" + std::to_string(b), level + 1, dirs)) { return false; }
+    }
+    return true;
+  }
+
+  static long GetTime() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_nsec + ((long)time.tv_sec * 1000000000);
+  }
+
+  std::string GetTreeRoot(int tree) const {
+    return config_.root + (config_.shared ? "/md-shared" : "/md-t" + std::to_string(tree));
+  }
+
+  PhaseResult RunPhase(Phase phase, int id) {
+    PhaseResult result;
+    const std::vector<std::string>& dirs = tree_dirs_[config_.shared ? 0 : id];
+    std::string prefix = (phase <= kDirRemove ? "/dir." : "/file.") + std::to_string(id) + ".";
+    for (const std::string& dir : dirs) {
+      if (phase == kReaddir) {
+        // every thread lists every directory of its tree once.
+        long begin = GetTime();
+        DIR* listing = opendir(dir.c_str());
+        if (listing == nullptr) {
+          ++result.errors;
+        } else {
+          while (readdir(listing) != nullptr) { }
+          closedir(listing);
+        }
+        result.latency.Record(GetTime() - begin);
+        ++result.ops;
+        continue;
+      }
+
+      for (int i = 0; i < config_.items; ++i) {
+        std::string path = dir + prefix + std::to_string(i);
+        struct stat st;
+        int ret = 0;
+        long begin = GetTime();
+        switch (phase) {
+          case kDirCreate: ret = mkdir(path.c_str(), 0755); break;
+          case kDirStat: case kFileStat: ret = stat(path.c_str(), &st); break;
+          case kDirRemove: ret = rmdir(path.c_str()); break;
+          case kFileCreate:
+            ret = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            ret = ret < 0 ? ret : close(ret);
+            break;
+          case kFileRemove: ret = unlink(path.c_str()); break;
+          default: break;
+        }
+        result.latency.Record(GetTime() - begin);
+        ++result.ops;
+        result.errors += ret != 0;
+      }
+    }
+    return result;
+  }
+
+  // blocks until every thread has called, then sets time to when the last
+  // one arrived.
+  void Wait(long* time) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    long generation = generation_;
+    if (++waiting_ == config_.threads) {
+      *time = GetTime();
+      waiting_ = 0;
+      ++generation_;
+      all_arrived_.notify_all();
+      return;
+    }
+    all_arrived_.wait(lock, [&]() { return generation_ != generation; });
+  }
+
+  Config config_;
+  std::vector<std::vector<std::string>> tree_dirs_;
+  std::mutex mutex_;
+  std::condition_variable all_arrived_;
+  int waiting_;
+  long generation_;
+};
@@ -0,0 +1,8 @@
+# a 9:1 read/write mix over 200 files, most reads going to a few of them.
+files 200
+zipf 0.99
+op DownloadFile 8
+op GetFileInfo 1
+op UploadFile 1
+size 4096 3
+size 65536 1
@@ -0,0 +1,224 @@
+// report.h
+// by: allison morris
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <sys/utsname.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "histogram.h"
+
+// machine-readable benchmark results. a driver started with "--json file" or
+// "--csv file" ahead of its usual arguments collects one entry per
+// benchmark it runs, each with its full latency distribution in
+// nanoseconds, and writes them to file together with a description of the
+// machine and build they came from. the console output is unchanged.
+//
+// the json form is
+//   { "environment": { "host": ..., ... },
+//     "benchmarks": [ { "name": ..., "count": ..., "p50": ..., ...,
+//       "metrics": { ... }, "distribution": [ [value, count], ... ] } ] }
+// and the csv form has the environment as "# key=value" lines followed by a
+// header and one row per benchmark, with the distribution as a single
+// "value:count value:count ..." field. compare_results reads the csv form.
+class Report {
+public:
+  enum Format { kNone, kJson, kCsv };
+
+  struct Entry {
+    std::string name;
+    Histogram distribution;
+    long errors;
+    // other results of the benchmark, like its throughput.
+    std::vector<std::pair<std::string, double>> metrics;
+
+    Entry() : errors(0) { }
+  };
+
+  Report() : format_(kNone) { }
+
+  // starts a new entry for benchmark name. it is valid until the next Add.
+  Entry* Add(const std::string& name) {
+    entries_.push_back(Entry());
+    entries_.back().name = name;
+    return &entries_.back();
+  }
+
+  bool IsEnabled() const { return format_ != kNone; }
+
+  // takes "--json file" or "--csv file" off the front of argv, keeping
+  // argv[0], and remembers the whole command line. returns false if the
+  // option is missing its file.
+  template <typename Char>
+  bool ParseOption(int* argc, Char*** argv) {
+    for (int i = 0; i < *argc; ++i) {
+      command_ += (i == 0 ? "" : " ") + std::string((*argv)[i]);
+    }
+    if (*argc < 2) { return true; }
+    std::string option = (*argv)[1];
+    if (option != "--json" && option != "--csv") { return true; }
+    if (*argc < 3) { return false; }
+    format_ = option == "--json" ? kJson : kCsv;
+    path_ = (*argv)[2];
+    (*argv)[2] = (*argv)[0];
+    *argc -= 2;
+    *argv += 2;
+    return true;
+  }
+
+  // writes every entry to the file named on the command line. returns false
+  // if it could not be written.
+  bool Write() const {
+    if (!IsEnabled()) { return true; }
+    std::ofstream out(path_);
+    if (format_ == kJson) {
+      WriteJson(out);
+    } else {
+      WriteCsv(out);
+    }
+    out.close();
+    return !out.fail();
+  }
+private:
+  static std::string FormatTime() {
+    char text[32];
+    time_t now = time(nullptr);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return text;
+  }
+
+  static std::string GetCpuModel() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+      if (line.compare(0, 10, "model name") != 0) { continue; }
+      size_t colon = line.find(':');
+      return colon == std::string::npos ? line : line.substr(colon + 2);
+    }
+    return "unknown";
+  }
+
+  std::vector<std::pair<std::string, std::string>> GetEnvironment() const {
+    std::vector<std::pair<std::string, std::string>> env;
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    struct utsname name;
+    std::string kernel = "unknown";
+    if (uname(&name) == 0) {
+      kernel = std::string(name.sysname) + " " + name.release + " " + name.machine;
+    }
+    env.push_back(std::make_pair("command", command_));
+    env.push_back(std::make_pair("time", FormatTime()));
+    env.push_back(std::make_pair("host", std::string(host)));
+    env.push_back(std::make_pair("kernel", kernel));
+    env.push_back(std::make_pair("cpu", GetCpuModel()));
+    env.push_back(std::make_pair("cpus", std::to_string(std::thread::hardware_concurrency())));
+    env.push_back(std::make_pair("compiler", std::string(__VERSION__)));
+#ifdef __OPTIMIZE__
+    env.push_back(std::make_pair("optimized", std::string("yes")));
+#else
+    env.push_back(std::make_pair("optimized", std::string("no")));
+#endif
+    return env;
+  }
+
+  static std::string QuoteCsv(const std::string& text) {
+    if (text.find_first_of(",\"\n") == std::string::npos) { return text; }
+    std::string quoted = "\"";
+    for (char c : text) {
+      quoted += c;
+      if (c == '"') { quoted += c; }
+    }
+    return quoted + "\"";
+  }
+
+  static std::string QuoteJson(const std::string& text) {
+    std::string quoted = "\"";
+    for (unsigned char c : text) {
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+        quoted += c;
+      } else if (c < 0x20) {
+        char escape[8];
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        quoted += escape;
+      } else {
+        quoted += c;
+      }
+    }
+    return quoted + "\"";
+  }
+
+  void WriteCsv(std::ostream& out) const {
+    for (const auto& pair : GetEnvironment()) {
+      out << "# " << pair.first << "=" << pair.second << "\n";
+    }
+    out << "benchmark,count,errors,mean,min,p50,p90,p99,p99.9,max,metrics,distribution\n";
+    std::vector<std::pair<long, long>> buckets;
+    for (const Entry& entry : entries_) {
+      const Histogram& h = entry.distribution;
+      out << QuoteCsv(entry.name) << "," << h.GetCount() << "," << entry.errors << ","
+        << h.GetMean() << "," << h.GetMin() << "," << h.GetPercentile(50) << ","
+        << h.GetPercentile(90) << "," << h.GetPercentile(99) << ","
+        << h.GetPercentile(99.9) << "," << h.GetMax() << ",";
+      for (size_t i = 0; i < entry.metrics.size(); ++i) {
+        out << (i == 0 ? "" : " ") << entry.metrics[i].first << "=" << entry.metrics[i].second;
+      }
+      out << ",";
+      h.GetBuckets(&buckets);
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        out << (i == 0 ? "" : " ") << buckets[i].first << ":" << buckets[i].second;
+      }
+      out << "\n";
+    }
+  }
+
+  void WriteJson(std::ostream& out) const {
+    out << "{\n  \"environment\": {";
+    auto env = GetEnvironment();
+    for (size_t i = 0; i < env.size(); ++i) {
+      out << (i == 0 ? "\n" : ",\n") << "    " << QuoteJson(env[i].first) << ": "
+        << QuoteJson(env[i].second);
+    }
+    out << "\n  },\n  \"benchmarks\": [";
+    std::vector<std::pair<long, long>> buckets;
+    for (size_t e = 0; e < entries_.size(); ++e) {
+      const Entry& entry = entries_[e];
+      const Histogram& h = entry.distribution;
+      out << (e == 0 ? "\n" : ",\n") << "    {\"name\": " << QuoteJson(entry.name)
+        << ", \"unit\": \"ns\", \"count\": " << h.GetCount() << ", \"errors\": "
+        << entry.errors << ", \"mean\": " << h.GetMean() << ", \"min\": " << h.GetMin()
+        << ", \"p50\": " << h.GetPercentile(50) << ", \"p90\": " << h.GetPercentile(90)
+        << ", \"p99\": " << h.GetPercentile(99) << ", \"p99.9\": "
+        << h.GetPercentile(99.9) << ", \"max\": " << h.GetMax() << ",\n     \"metrics\": {";
+      for (size_t i = 0; i < entry.metrics.size(); ++i) {
+        out << (i == 0 ? "" : ", ") << QuoteJson(entry.metrics[i].first) << ": "
+          << entry.metrics[i].second;
+      }
+      out << "},\n     \"distribution\": [";
+      h.GetBuckets(&buckets);
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        out << (i == 0 ? "" : ", ") << "[" << buckets[i].first << ", " << buckets[i].second
+          << "]";
+      }
+      out << "]}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+  Format format_;
+  std::string path_;
+  std::string command_;
+  std::vector<Entry> entries_;
+};
+
+#endif
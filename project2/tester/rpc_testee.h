@@ -0,0 +1,193 @@
+// rpc_testee.h
+// by: allison morris
+
+// testees that call BasicFileService directly through a C++ stub instead of
+// going through the FUSE mount. they run the same workloads on the same
+// files as the mount testees (remote path p, thread i uses p-ti), so the
+// difference between the two is what the Go FUSE client adds on top of the
+// server. built only into rpc_tester, which links grpc.
+
+#include <algorithm>
+#include <cstring>
+#include <grpc++/generic/generic_stub.h>
+#include <grpc++/grpc++.h>
+#include <memory>
+#include <vector>
+#include "data_plane.h"
+#include "file.grpc.pb.h"
+
+class RpcTestee : public Testee {
+public:
+  // operations are a (GetFileInfo), r (DownloadFile), s (DownloadFileStream),
+  // b (a raw read through filed -B's DataPlane) and w (UploadFile). threads
+  // share channels round robin; every channel is its own connection. writes
+  // send size bytes, or the file's current size if size is 0.
+  class RpcArgs : public Args {
+  public:
+    RpcArgs(const std::string& server, const char* name, char op, int thr, int tr,
+        int channels, int sz) : Args(name, thr, tr, sz), operation_(op) {
+      for (int i = 0; i < channels; ++i) {
+        // a distinct argument keeps grpc from sharing one connection.
+        grpc::ChannelArguments channel_args;
+        channel_args.SetInt("tester.channel", i);
+        std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(
+          server, grpc::InsecureCredentials(), channel_args);
+        stubs_.push_back(File::BasicFileService::NewStub(channel));
+        generic_stubs_.push_back(std::unique_ptr<grpc::GenericStub>(
+          new grpc::GenericStub(channel)));
+      }
+    }
+
+    grpc::GenericStub* GetGenericStub(int id) const {
+      return generic_stubs_[id % generic_stubs_.size()].get();
+    }
+
+    char GetOperation() const { return operation_; }
+
+    File::BasicFileService::Stub* GetStub(int id) const {
+      return stubs_[id % stubs_.size()].get();
+    }
+  private:
+    char operation_;
+    std::vector<std::unique_ptr<File::BasicFileService::Stub>> stubs_;
+    std::vector<std::unique_ptr<grpc::GenericStub>> generic_stubs_;
+  };
+
+  int Run(const Args& args, int id) {
+    const RpcArgs& rpc_args = *(const RpcArgs*)&args;
+    File::BasicFileService::Stub* stub = rpc_args.GetStub(id);
+    File::Path path;
+    path.set_data(GetFilename(args, id));
+
+    switch (rpc_args.GetOperation()) {
+      case 'a': {
+        grpc::ClientContext ctx;
+        File::FileInfo info;
+        grpc::Status status = stub->GetFileInfo(&ctx, path, &info);
+        return status.ok() ? info.error_code() : -1;
+      }
+      case 'r': {
+        grpc::ClientContext ctx;
+        File::File file;
+        grpc::Status status = stub->DownloadFile(&ctx, path, &file);
+        return status.ok() ? file.info().error_code() : -1;
+      }
+      case 's': {
+        grpc::ClientContext ctx;
+        File::FileChunk chunk;
+        int err = 0;
+        std::unique_ptr<grpc::ClientReader<File::FileChunk>> reader =
+          stub->DownloadFileStream(&ctx, path);
+        while (reader->Read(&chunk)) {
+          if (chunk.has_info() && chunk.info().error_code() != 0) { err = chunk.info().error_code(); }
+        }
+        return reader->Finish().ok() ? err : -1;
+      }
+      case 'b':
+        return ReadRaw(rpc_args.GetGenericStub(id), path.data());
+      default: {
+        // like the mount's write test, find the size first.
+        long size = args.GetSize();
+        if (size == 0) {
+          grpc::ClientContext ctx;
+          File::FileInfo info;
+          grpc::Status status = stub->GetFileInfo(&ctx, path, &info);
+          if (!status.ok() || info.error_code() != 0) { return -1; }
+          size = info.size();
+        }
+        grpc::ClientContext ctx;
+        File::FileData data;
+        File::FileInfo info;
+        *data.mutable_path() = path;
+        data.mutable_contents()->assign(size, 'x');
+        grpc::Status status = stub->UploadFile(&ctx, data, &info);
+        return status.ok() ? info.error_code() : -1;
+      }
+    }
+  }
+protected:
+  // reads the whole file at path through the DataPlane, waiting on each
+  // step of the async call in turn. the chunks are only checked, not
+  // copied out of grpc's slices. returns the error code from the chunk
+  // headers, or -1 if the call failed.
+  static int ReadRaw(grpc::GenericStub* stub, const std::string& path) {
+    grpc::ClientContext ctx;
+    grpc::CompletionQueue cq;
+    std::unique_ptr<grpc::GenericClientAsyncReaderWriter> call =
+      stub->PrepareCall(&ctx, File::DataPlane::GetReadMethod(), &cq);
+    auto wait = [&cq]() {
+      void* tag;
+      bool ok = false;
+      return cq.Next(&tag, &ok) && ok;
+    };
+
+    File::DataPlane::RequestHeader header = { 0, 0, 0 };
+    std::string request = File::DataPlane::EncodeRequest(header, path);
+    grpc::Slice slice(request.data(), request.size());
+    grpc::ByteBuffer message(&slice, 1);
+    int err = -1;
+    call->StartCall(&ctx);
+    if (wait()) {
+      call->Write(message, &ctx);
+      if (wait()) {
+        call->WritesDone(&ctx);
+        if (wait()) { err = 0; }
+      }
+    }
+    while (err == 0) {
+      call->Read(&message, &ctx);
+      if (!wait()) { break; }
+      // the header is small enough that grpc never splits it, but gather it
+      // from the slices anyway.
+      std::vector<grpc::Slice> slices;
+      message.Dump(&slices);
+      char head[File::DataPlane::kChunkHeaderSize];
+      size_t got = 0;
+      for (size_t i = 0; i < slices.size() && got < sizeof(head); ++i) {
+        size_t take = std::min(sizeof(head) - got, slices[i].size());
+        memcpy(head + got, slices[i].begin(), take);
+        got += take;
+      }
+      File::DataPlane::ChunkHeader chunk;
+      if (!File::DataPlane::DecodeChunk(head, got, &chunk)) {
+        err = -1;
+      } else {
+        err = chunk.error_code;
+      }
+    }
+    grpc::Status status;
+    call->Finish(&status, &ctx);
+    wait();
+    return status.ok() ? err : -1;
+  }
+
+  // server path op [count] [channels] [size], where count is threads or
+  // trials.
+  static Args* ParseRpc(int argc, const char** argv, bool threads) {
+    if (argc < 4) { return nullptr; }
+    char op = argv[3][0];
+    if ((op != 'a' && op != 'b' && op != 'r' && op != 's' && op != 'w') || argv[3][1] != 0) {
+      return nullptr;
+    }
+    int count = argc >= 5 ? strtol(argv[4], nullptr, 10) : 1;
+    int channels = argc >= 6 ? strtol(argv[5], nullptr, 10) : 1;
+    int size = argc >= 7 ? strtol(argv[6], nullptr, 10) : 0;
+    if (count < 1 || channels < 1 || size < 0) { return nullptr; }
+    return new RpcArgs(argv[1], argv[2], op, threads ? count : 1, threads ? 1 : count,
+      channels, size);
+  }
+};
+
+class RpcMultiTest : public RpcTestee {
+public:
+  Args* Parse(int argc, const char** argv) {
+    return ParseRpc(argc, argv, true);
+  }
+};
+
+class RpcSingleTest : public RpcTestee {
+public:
+  Args* Parse(int argc, const char** argv) {
+    return ParseRpc(argc, argv, false);
+  }
+};
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# metadata storms against the mount: a wide flat tree and a deep narrow
+# one, with threads in their own trees and then all in one.
+
+EXE=./tester
+ROOT=../clientbazil/root
+#ROOT=tests/data
+
+for threads in 1 4 16
+do
+  for sharing in unique shared
+  do
+    $EXE Metadata $ROOT $threads 1 16 64 $sharing
+    $EXE Metadata $ROOT $threads 4 2 16 $sharing
+  done
+done
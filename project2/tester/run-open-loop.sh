@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# steps the offered load up until the achieved rate stops following it.
+# the knee in latency percentiles is filed's saturation point.
+
+EXE=./tester
+ROOT=../clientbazil/root
+#ROOT=tests/data
+SECONDS_PER_RATE=10
+WORKERS=64
+
+for size in 4k 256k
+do
+  for rate in 50 100 200 400 800 1600 3200
+  do
+    $EXE OpenLoop $rate $SECONDS_PER_RATE poisson $WORKERS MultiReadWrite $ROOT/blob-$size r 8
+  done
+done
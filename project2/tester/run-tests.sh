@@ -1,13 +1,27 @@
 #!/bin/bash
 
+# with a file argument, also collects every run's results there as csv, for
+# compare_results.
+
 EXE=./tester
 ROOT=../clientbazil/root
 #ROOT=tests/data
+OUT=$1
+
+run() {
+  if [ -n "$OUT" ]; then
+    $EXE --csv $OUT.run "$@" && cat $OUT.run >> $OUT
+    rm -f $OUT.run
+  else
+    $EXE "$@"
+  fi
+}
 
+if [ -n "$OUT" ]; then rm -f $OUT; fi
 for i in 2k 4k 16k 256k 4m 16m 64m
 do
- $EXE SingleAccess $ROOT/blob-$i 1
- $EXE SingleAccess $ROOT/blob-$i 20
- $EXE SingleReadWrite $ROOT/blob-$i r 5
- $EXE SingleReadWrite $ROOT/blob-$i w 5
+ run SingleAccess $ROOT/blob-$i 1
+ run SingleAccess $ROOT/blob-$i 20
+ run SingleReadWrite $ROOT/blob-$i r 5
+ run SingleReadWrite $ROOT/blob-$i w 5
 done
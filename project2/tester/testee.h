@@ -17,6 +17,9 @@ public:
     Args(const std::string& name, int thr, int tr, int sz)
       : filename_(name), threads_(thr), trials_(tr), size_(sz) { }
 
+    // testees hand out derived args as Args*.
+    virtual ~Args() { }
+
     const std::string& GetFilename() const { return filename_; }
     int GetSize() const { return size_; }
     int GetThreads() const { return threads_; }
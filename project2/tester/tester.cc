@@ -2,19 +2,47 @@
 // by: allison morris
 
 
+#include "histogram.h"
+#include "metadata_test.h"
+#include "report.h"
 #include "testee.h"
+#include "workload.h"
+#ifdef RPC_TESTEES
+#include "rpc_testee.h"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <functional>
 #include <map>
+#include <random>
+#include <sstream>
 #include <time.h>
 #include <thread>
 #include <vector>
 
 class Tester {
 public:
+  // how open-loop operations are spaced: evenly, or as a poisson process.
+  enum Arrival { kConstant, kPoisson };
+
   struct Result {
     long time;
     int error;
   };
 
+  // latency runs from when an operation was scheduled to start, service
+  // time from when a worker actually started it.
+  struct OpenLoopResult {
+    Histogram latency;
+    Histogram service;
+    long errors;
+    long elapsed;
+
+    OpenLoopResult() : errors(0), elapsed(0) { }
+  };
+
   class TimeVector : private std::vector<Result> {
   public:
     typedef std::vector<Result> Vector;
@@ -44,6 +72,16 @@ public:
       return min;
     }
 
+    // adds every result's time to histogram and returns how many failed.
+    long Record(Histogram* histogram) const {
+      long errors = 0;
+      for (auto result : *this) {
+        histogram->Record(result.time);
+        errors += result.error != 0;
+      }
+      return errors;
+    }
+
     Result* NewResult() {
       push_back(Result());
       return &back();
@@ -94,6 +132,72 @@ public:
     testees_["MultiReadWrite"] = new MultiReadWriteTest();
     testees_["SingleAccess"] = new SingleAccessTest();
     testees_["SingleReadWrite"] = new SingleReadWriteTest();
+    testees_["Workload"] = new WorkloadTest();
+#ifdef RPC_TESTEES
+    testees_["RpcMulti"] = new RpcMultiTest();
+    testees_["RpcSingle"] = new RpcSingleTest();
+#endif
+  }
+
+  // issues operations of testee at rate per second for seconds, on up to
+  // workers threads. operation i uses file i modulo the test's thread count.
+  void RunOpenLoop(const Testee::Args& args, Testee* testee, double rate, double seconds,
+      Arrival arrival, int workers, OpenLoopResult* out) {
+    std::vector<long> schedule;
+    std::mt19937_64 random(GetTime());
+    std::exponential_distribution<double> gap(rate);
+    for (double t = 0;;) {
+      t += arrival == kPoisson ? gap(random) : 1.0 / rate;
+      if (t >= seconds) { break; }
+      schedule.push_back((long)(t * 1e9));
+    }
+    RunScheduled(schedule, workers, [&](size_t i) {
+      return testee->Run(args, i % args.GetThreads());
+    }, out);
+  }
+
+  // runs operation(i) at schedule[i] nanoseconds after the start, on up to
+  // workers threads. operations are scheduled up front and each one's
+  // latency is counted from its scheduled start, so when the server falls
+  // behind the queue it builds is charged to it rather than hidden by the
+  // load generator slowing down.
+  void RunScheduled(const std::vector<long>& schedule, int workers,
+      const std::function<int(size_t)>& operation, OpenLoopResult* out) {
+    std::atomic<size_t> next(0);
+    std::vector<OpenLoopResult> partial(workers);
+    std::vector<std::thread> threads;
+    // give the workers a moment to start before the first operation is due.
+    long start = GetTime() + 10 * 1000 * 1000;
+    for (int w = 0; w < workers; ++w) {
+      threads.push_back(std::thread([&, w]() {
+        OpenLoopResult& result = partial[w];
+        for (size_t i = next++; i < schedule.size(); i = next++) {
+          long intended = start + schedule[i];
+          SleepUntil(intended);
+          long begin = GetTime();
+          int err = operation(i);
+          long end = GetTime();
+          result.latency.Record(end - intended);
+          result.service.Record(end - begin);
+          result.errors += err != 0;
+        }
+      }));
+    }
+    for (auto& thread : threads) { thread.join(); }
+
+    out->elapsed = GetTime() - start;
+    for (const OpenLoopResult& result : partial) {
+      out->latency.Add(result.latency);
+      out->service.Add(result.service);
+      out->errors += result.errors;
+    }
+  }
+
+  static void SleepUntil(long time) {
+    timespec when;
+    when.tv_sec = time / 1000000000;
+    when.tv_nsec = time % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR) { }
   }
 
   void Run(const Testee::Args& args, const std::string& name, TimeVector* out) {
@@ -108,21 +212,228 @@ private:
   std::map<std::string, Testee*> testees_;
 };
 
-int main(int argc, const char** argv) {
-  Tester tester;
-  tester.Initialize();
+// names a benchmark in a report by its arguments, from argv[first] on.
+std::string JoinArgs(int argc, const char** argv, int first) {
+  std::string joined;
+  for (int i = first; i < argc; ++i) {
+    joined += (i == first ? "" : " ") + std::string(argv[i]);
+  }
+  return joined;
+}
 
-  if (argc < 2) {
-    std::cout << "need test name followed by args, if any\n";
+void PrintDistribution(const char* label, const Histogram& histogram) {
+  std::cout << "  " << label << " p50: " << histogram.GetPercentile(50)
+    << " p90: " << histogram.GetPercentile(90)
+    << " p99: " << histogram.GetPercentile(99)
+    << " p99.9: " << histogram.GetPercentile(99.9)
+    << " max: " << histogram.GetMax() << std::endl;
+}
+
+// adds the latency and service time distributions of a scheduled run to
+// report, with the rate it achieved.
+void AddOpenLoopEntries(const std::string& test, const Tester::OpenLoopResult& result,
+    Report* report) {
+  double rate = result.latency.GetCount() / (result.elapsed / 1e9);
+  Report::Entry* entry = report->Add(test + " latency");
+  entry->distribution = result.latency;
+  entry->errors = result.errors;
+  entry->metrics.push_back(std::make_pair("achieved_rate", rate));
+  entry = report->Add(test + " service");
+  entry->distribution = result.service;
+  entry->errors = result.errors;
+  entry->metrics.push_back(std::make_pair("achieved_rate", rate));
+}
+
+// OpenLoop rate seconds constant|poisson workers test [test args]
+int RunOpenLoop(Tester* tester, int argc, const char** argv, Report* report) {
+  if (argc < 7) {
+    std::cout << "OpenLoop needs rate, seconds, constant or poisson, workers and a test\n";
+    return 1;
+  }
+  double rate = strtod(argv[2], nullptr);
+  double seconds = strtod(argv[3], nullptr);
+  std::string arrival = argv[4];
+  int workers = strtol(argv[5], nullptr, 10);
+  Testee* testee = tester->FindTestee(argv[6]);
+  if (rate <= 0 || seconds <= 0 || workers <= 0 || testee == nullptr ||
+      (arrival != "constant" && arrival != "poisson")) {
+    std::cout << "bad OpenLoop arguments\n";
+    return 1;
+  }
+  Testee::Args* args = testee->Parse(argc - 6, argv + 6);
+  if (args == nullptr) {
+    std::cout << "bad arguments for test " << argv[6] << "\n";
+    return 1;
+  }
+
+  Tester::OpenLoopResult result;
+  tester->RunOpenLoop(*args, testee, rate, seconds,
+    arrival == "poisson" ? Tester::kPoisson : Tester::kConstant, workers, &result);
+
+  double elapsed = result.elapsed / 1e9;
+  std::cout << "Completed " << result.latency.GetCount() << " operations in " << elapsed
+    << " s across " << workers << " workers for test ";
+  for (int i = 6; i < argc; ++i) {
+    std::cout << argv[i] << " ";
+  }
+  std::cout << std::endl
+    << "  Target rate: " << rate << "/s " << arrival << std::endl
+    << "  Achieved rate: " << result.latency.GetCount() / elapsed << "/s" << std::endl
+    << "  Errors: " << result.errors << std::endl;
+  PrintDistribution("Latency", result.latency);
+  PrintDistribution("Service time", result.service);
+
+  std::string test = JoinArgs(argc, argv, 6) + " at " + argv[2] + "/s " + arrival;
+  AddOpenLoopEntries(test, result, report);
+  return 0;
+}
+
+// Replay trace root timed|asap speed workers
+int RunReplay(Tester* tester, int argc, const char** argv, Report* report) {
+  if (argc < 7) {
+    std::cout << "Replay needs a trace, root, timed or asap, speed and workers\n";
+    return 1;
+  }
+  std::ifstream trace(argv[2]);
+  std::string root = argv[3];
+  std::string timing = argv[4];
+  double speed = strtod(argv[5], nullptr);
+  int workers = strtol(argv[6], nullptr, 10);
+  if (!trace || speed <= 0 || workers <= 0 || (timing != "timed" && timing != "asap")) {
+    std::cout << "bad Replay arguments\n";
+    return 1;
+  }
+
+  // each line is "<ns since start> <rpc> <bytes> <path>[ /// <to>]", as
+  // written by filed -R.
+  struct Call {
+    MountCall::Type type;
+    long bytes;
+    std::string path;
+    std::string to;
+  };
+  std::vector<Call> calls;
+  std::vector<long> schedule;
+  long skipped = 0;
+  std::string line;
+  while (std::getline(trace, line)) {
+    std::istringstream fields(line);
+    long time;
+    std::string rpc;
+    Call call;
+    if (!(fields >> time >> rpc >> call.bytes) || !MountCall::ToType(rpc, &call.type) ||
+        fields.get() != ' ' || !std::getline(fields, call.path)) {
+      ++skipped;
+      continue;
+    }
+    size_t split = call.path.find(" /// ");
+    if (split != std::string::npos) {
+      call.to = root + "/" + call.path.substr(split + 5);
+      call.path.erase(split);
+    }
+    call.path = root + "/" + call.path;
+    calls.push_back(call);
+    schedule.push_back(time);
+  }
+  // filed stamps calls with their start but writes them as they finish, so
+  // the lines are not quite in order of arrival.
+  std::vector<size_t> order(calls.size());
+  for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return schedule[a] < schedule[b];
+  });
+  std::vector<long> sorted(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    long since = schedule[order[i]] - schedule[order[0]];
+    sorted[i] = timing == "timed" ? (long)(since / speed) : 0;
+  }
+
+  Tester::OpenLoopResult result;
+  tester->RunScheduled(sorted, workers, [&](size_t i) {
+    const Call& call = calls[order[i]];
+    return MountCall::Run(call.type, call.path, call.to, call.bytes);
+  }, &result);
+
+  double elapsed = result.elapsed / 1e9;
+  std::cout << "Replayed " << result.latency.GetCount() << " calls in " << elapsed
+    << " s across " << workers << " workers for test ";
+  for (int i = 1; i < argc; ++i) {
+    std::cout << argv[i] << " ";
+  }
+  std::cout << std::endl
+    << "  Achieved rate: " << result.latency.GetCount() / elapsed << "/s" << std::endl
+    << "  Errors: " << result.errors << std::endl
+    << "  Skipped lines: " << skipped << std::endl;
+  // with asap every call is due at once, so only service time means much.
+  if (timing == "timed") { PrintDistribution("Latency", result.latency); }
+  PrintDistribution("Service time", result.service);
+  AddOpenLoopEntries(JoinArgs(argc, argv, 1), result, report);
+  return 0;
+}
+
+// Metadata root threads depth branch items shared|unique
+int RunMetadata(int argc, const char** argv, Report* report) {
+  if (argc < 8) {
+    std::cout << "Metadata needs root, threads, depth, branch, items and shared or unique\n";
+    return 1;
+  }
+  MetadataTest::Config config;
+  config.root = argv[2];
+  config.threads = strtol(argv[3], nullptr, 10);
+  config.depth = strtol(argv[4], nullptr, 10);
+  config.branch = strtol(argv[5], nullptr, 10);
+  config.items = strtol(argv[6], nullptr, 10);
+  std::string sharing = argv[7];
+  config.shared = sharing == "shared";
+  if (config.threads <= 0 || config.depth < 0 || config.branch <= 0 || config.items <= 0 ||
+      (sharing != "shared" && sharing != "unique")) {
+    std::cout << "bad Metadata arguments\n";
+    return 1;
+  }
+
+  MetadataTest test(config);
+  MetadataTest::PhaseResult results[MetadataTest::kPhaseCount];
+  if (!test.Run(results)) {
+    std::cout << "could not build the directory tree under " << config.root << "\n";
     return 1;
   }
 
+  std::cout << "Completed metadata test across " << config.threads << " threads for test ";
+  for (int i = 1; i < argc; ++i) {
+    std::cout << argv[i] << " ";
+  }
+  std::cout << std::endl;
+  for (int p = 0; p < MetadataTest::kPhaseCount; ++p) {
+    const MetadataTest::PhaseResult& result = results[p];
+    std::cout << "  " << MetadataTest::GetPhaseName((MetadataTest::Phase)p) << ": "
+      << result.ops * 1e9 / std::max(result.time, 1L) << " ops/s (" << result.ops
+      << " ops, " << result.errors << " errors)" << std::endl;
+    Report::Entry* entry = report->Add(JoinArgs(argc, argv, 1) + " " +
+      MetadataTest::GetPhaseName((MetadataTest::Phase)p));
+    entry->distribution = result.latency;
+    entry->errors = result.errors;
+    entry->metrics.push_back(std::make_pair("ops_per_s",
+      result.ops * 1e9 / std::max(result.time, 1L)));
+  }
+  return 0;
+}
+
+// test [test args]
+int RunTest(Tester* tester, int argc, const char** argv, Report* report) {
   std::string name = argv[1];
-  Testee* testee = tester.FindTestee(name);
+  Testee* testee = tester->FindTestee(name);
+  if (testee == nullptr) {
+    std::cout << "no test named " << name << "\n";
+    return 1;
+  }
   Testee::Args* args = testee->Parse(argc - 1, argv + 1);
+  if (args == nullptr) {
+    std::cout << "bad arguments for test " << name << "\n";
+    return 1;
+  }
   Tester::TimeVector results;
 
-  tester.Run(*args, name, &results);
+  tester->Run(*args, name, &results);
 
   std::cout << "Completed " << args->GetTrials() << " trials across " << args->GetThreads()
     << " threads for test ";
@@ -133,5 +444,39 @@ int main(int argc, const char** argv) {
     << "  Avg time: " << results.GetAvg() << std::endl
     << "  Max time: " << results.GetMax() << std::endl
     << "  Min time: " << results.GetMin() << std::endl;
+  Report::Entry* entry = report->Add(JoinArgs(argc, argv, 1));
+  entry->errors = results.Record(&entry->distribution);
   return 0;
 }
+
+int main(int argc, const char** argv) {
+  Tester tester;
+  tester.Initialize();
+  Report report;
+
+  if (!report.ParseOption(&argc, &argv)) {
+    std::cout << "--json and --csv need a file to write the results to\n";
+    return 1;
+  }
+  if (argc < 2) {
+    std::cout << "need test name followed by args, if any\n";
+    return 1;
+  }
+
+  std::string name = argv[1];
+  int ret;
+  if (name == "OpenLoop") {
+    ret = RunOpenLoop(&tester, argc, argv, &report);
+  } else if (name == "Metadata") {
+    ret = RunMetadata(argc, argv, &report);
+  } else if (name == "Replay") {
+    ret = RunReplay(&tester, argc, argv, &report);
+  } else {
+    ret = RunTest(&tester, argc, argv, &report);
+  }
+  if (ret == 0 && !report.Write()) {
+    std::cout << "could not write the results\n";
+    return 1;
+  }
+  return ret;
+}
@@ -0,0 +1,312 @@
+// workload.h
+// by: allison morris
+
+// a mix of file service calls, played against the filed mount. a workload
+// spec describes the mix with one setting per line:
+//
+//   files <n>              how many files the workload draws from
+//   zipf <theta>           popularity skew; 0 picks files uniformly
+//   op <rpc> <weight>      how often each call is made, by rpc name
+//   size <bytes> <weight>  how large each upload is
+//
+// blank lines and lines starting with # are ignored. so a 9:1 read/write mix
+// over 10000 files, hot at the front, is "files 10000", "zipf 0.99",
+// "op DownloadFile 9" and "op UploadFile 1". the files are named w-<i>
+// under the root and are created, at a size drawn from the size mix, before
+// the run starts.
+//
+// every call is carried out as the posix operations a client of the mount
+// would use for it, which is also how Replay plays back traces that filed
+// records with -R.
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+class MountCall {
+public:
+  enum Type {
+    kCopy, kCreateDirectory, kCreateFile, kDownloadFile, kGetDirectoryContents,
+    kGetFileInfo, kRemoveDirectory, kRemoveFile, kRename, kUploadFile, kTypeCount
+  };
+
+  // the three download rpcs all read the file through the mount.
+  static bool ToType(const std::string& rpc, Type* type) {
+    static const char* kNames[] = {
+      "Copy", "CreateDirectory", "CreateFile", "DownloadFile", "GetDirectoryContents",
+      "GetFileInfo", "RemoveDirectory", "RemoveFile", "Rename", "UploadFile"
+    };
+    if (rpc == "DownloadFileStream" || rpc == "DownloadRange") {
+      *type = kDownloadFile;
+      return true;
+    }
+    for (int i = 0; i < kTypeCount; ++i) {
+      if (rpc == kNames[i]) {
+        *type = (Type)i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // makes one call on path, with to as the destination of a copy or rename
+  // and size as the length of an upload. returns 0 or -errno.
+  static int Run(Type type, const std::string& path, const std::string& to, long size) {
+    struct stat st_buf;
+    switch (type) {
+    case kCopy:
+      return CopyFile(path, to);
+    case kCreateDirectory:
+      return mkdir(path.c_str(), 0755) == 0 ? 0 : -errno;
+    case kCreateFile: {
+      int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+      if (fd < 0) { return -errno; }
+      close(fd);
+      return 0;
+    }
+    case kDownloadFile:
+      return ReadFile(path);
+    case kGetDirectoryContents:
+      return ListDirectory(path);
+    case kGetFileInfo:
+      return stat(path.c_str(), &st_buf) == 0 ? 0 : -errno;
+    case kRemoveDirectory:
+      return rmdir(path.c_str()) == 0 ? 0 : -errno;
+    case kRemoveFile:
+      return unlink(path.c_str()) == 0 ? 0 : -errno;
+    case kRename:
+      return rename(path.c_str(), to.c_str()) == 0 ? 0 : -errno;
+    case kUploadFile:
+      return WriteFile(path, size);
+    default:
+      return -EINVAL;
+    }
+  }
+private:
+  static const int kBufferSize = 64 * 1024;
+
+  static int CopyFile(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0) { return -errno; }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+      int err = -errno;
+      close(in);
+      return err;
+    }
+    std::vector<char> buffer(kBufferSize);
+    int err = 0;
+    for (;;) {
+      ssize_t count = read(in, buffer.data(), buffer.size());
+      if (count <= 0) {
+        err = count < 0 ? -errno : 0;
+        break;
+      }
+      if (write(out, buffer.data(), count) != count) {
+        err = -errno;
+        break;
+      }
+    }
+    close(in);
+    if (close(out) != 0 && err == 0) { err = -errno; }
+    return err;
+  }
+
+  static int ListDirectory(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) { return -errno; }
+    while (readdir(dir) != nullptr) { }
+    closedir(dir);
+    return 0;
+  }
+
+  static int ReadFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return -errno; }
+    std::vector<char> buffer(kBufferSize);
+    ssize_t count;
+    while ((count = read(fd, buffer.data(), buffer.size())) > 0) { }
+    int err = count < 0 ? -errno : 0;
+    close(fd);
+    return err;
+  }
+
+  static int WriteFile(const std::string& path, long size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return -errno; }
+    std::vector<char> buffer(kBufferSize, 'w');
+    int err = 0;
+    for (long done = 0; done < size;) {
+      ssize_t count = write(fd, buffer.data(), std::min<long>(size - done, kBufferSize));
+      if (count < 0) {
+        err = -errno;
+        break;
+      }
+      done += count;
+    }
+    // the upload reaches filed when the file is closed.
+    if (close(fd) != 0 && err == 0) { err = -errno; }
+    return err;
+  }
+};
+
+class WorkloadTest : public Testee {
+public:
+  class WorkloadArgs : public Args {
+  public:
+    WorkloadArgs(const std::string& root) : Args(root, 1, 1, 0), files_(0), zipf_(0) { }
+
+    // reads the spec at path. returns false, with a message in error, if it
+    // is unreadable or malformed.
+    bool Load(const std::string& path, std::string* error) {
+      std::ifstream spec(path);
+      if (!spec) {
+        *error = "could not read " + path;
+        return false;
+      }
+      std::string line;
+      for (int number = 1; std::getline(spec, line); ++number) {
+        std::istringstream fields(line);
+        std::string key;
+        if (!(fields >> key) || key[0] == '#') { continue; }
+        bool good;
+        if (key == "files") {
+          good = (fields >> files_) && files_ > 0;
+        } else if (key == "zipf") {
+          good = (fields >> zipf_) && zipf_ >= 0;
+        } else if (key == "op") {
+          std::string rpc;
+          double weight;
+          MountCall::Type type;
+          good = (fields >> rpc >> weight) && weight > 0 && MountCall::ToType(rpc, &type);
+          if (good) { ops_.push_back(std::make_pair(type, weight)); }
+        } else if (key == "size") {
+          long size;
+          double weight;
+          good = (fields >> size >> weight) && size >= 0 && weight > 0;
+          if (good) { sizes_.push_back(std::make_pair(size, weight)); }
+        } else {
+          good = false;
+        }
+        if (!good) {
+          *error = path + ":" + std::to_string(number) + ": bad line: " + line;
+          return false;
+        }
+      }
+      if (files_ == 0 || ops_.empty()) {
+        *error = path + " needs files and at least one op";
+        return false;
+      }
+      if (sizes_.empty()) { sizes_.push_back(std::make_pair(4096L, 1.0)); }
+
+      // file i is picked with probability proportional to 1 / (i + 1)^theta.
+      double total = 0;
+      popularity_.resize(files_);
+      for (long i = 0; i < files_; ++i) {
+        total += 1 / std::pow((double)(i + 1), zipf_);
+        popularity_[i] = total;
+      }
+      return true;
+    }
+
+    std::string GetPath(long file) const {
+      return GetFilename() + "/w-" + std::to_string(file);
+    }
+
+    long GetFiles() const { return files_; }
+
+    long PickFile(std::mt19937_64* random) const {
+      std::uniform_real_distribution<double> pick(0, popularity_.back());
+      auto iter = std::upper_bound(popularity_.begin(), popularity_.end(), pick(*random));
+      return std::min<long>(iter - popularity_.begin(), files_ - 1);
+    }
+
+    MountCall::Type PickOperation(std::mt19937_64* random) const {
+      return Pick(ops_, random);
+    }
+
+    long PickSize(std::mt19937_64* random) const {
+      return Pick(sizes_, random);
+    }
+  private:
+    template <typename T>
+    static T Pick(const std::vector<std::pair<T, double>>& choices, std::mt19937_64* random) {
+      double total = 0;
+      for (const auto& choice : choices) { total += choice.second; }
+      std::uniform_real_distribution<double> pick(0, total);
+      double point = pick(*random);
+      for (const auto& choice : choices) {
+        if (point < choice.second) { return choice.first; }
+        point -= choice.second;
+      }
+      return choices.back().first;
+    }
+
+    long files_;
+    double zipf_;
+    std::vector<std::pair<MountCall::Type, double>> ops_;
+    std::vector<std::pair<long, double>> sizes_;
+    // running sum of the file weights.
+    std::vector<double> popularity_;
+  };
+
+  // Workload spec root
+  Args* Parse(int argc, const char** argv) {
+    if (argc < 3) { return nullptr; }
+    WorkloadArgs* args = new WorkloadArgs(argv[2]);
+    std::string error;
+    if (!args->Load(argv[1], &error)) {
+      std::cout << error << "\n";
+      delete args;
+      return nullptr;
+    }
+    std::mt19937_64 random(args->GetFiles());
+    for (long i = 0; i < args->GetFiles(); ++i) {
+      struct stat st_buf;
+      std::string path = args->GetPath(i);
+      if (stat(path.c_str(), &st_buf) == 0) { continue; }
+      MountCall::Run(MountCall::kUploadFile, path, "", args->PickSize(&random));
+    }
+    return args;
+  }
+
+  // makes one call drawn from the mix. a copy or rename goes to another file
+  // of the workload; removes and renames thin the set out, so later calls on
+  // those files fail until something recreates them.
+  int Run(const Args& args, int) {
+    const WorkloadArgs& workload = *(const WorkloadArgs*)&args;
+    thread_local std::mt19937_64 random(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+    MountCall::Type type = workload.PickOperation(&random);
+    std::string path = workload.GetPath(workload.PickFile(&random));
+    std::string to;
+    switch (type) {
+    case MountCall::kCopy:
+    case MountCall::kRename:
+      to = workload.GetPath(workload.PickFile(&random));
+      break;
+    case MountCall::kCreateDirectory:
+    case MountCall::kRemoveDirectory:
+      path += ".d";
+      break;
+    case MountCall::kGetDirectoryContents:
+      path = workload.GetFilename();
+      break;
+    default:
+      break;
+    }
+    return MountCall::Run(type, path, to, workload.PickSize(&random));
+  }
+};